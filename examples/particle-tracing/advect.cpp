@@ -14,33 +14,39 @@
 
 #include "advect.h"
 #include "lerp.hpp"
+#include "rng.hpp"
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
 #include <string.h>
 
+// random displacement uniform in [-0.5, 0.5) in each dim
+// the random numbers are drawn from a counter-based generator (rng.hpp) with counter
+// (gid, pid, nsteps) of the particle and key seed, so they depend only on the particle and its step
 bool advect_brown(
         const int *st,      // min. corner of block
         const int *sz,      // size (number of points) in block
-        const float **vec,  // vector field
+        const VecField &vec, // vector field
         float *X,           // input point
         float h,            // step size
-        float *Y = NULL)    // output point if not NULL, otherwise in X
+        float *Y,           // output point if not NULL, otherwise in X
+        int gid,            // block gid of seed particle
+        int pid,            // particle id
+        int nsteps,         // number of steps the particle went so far
+        unsigned seed)      // random seed
 {
     if (!inside(3, st, sz, X)) return false;
 
-    if (Y)
-    {
-        Y[0] = X[0] + (float)rand()/RAND_MAX - 0.5;
-        Y[1] = X[1] + (float)rand()/RAND_MAX - 0.5;
-        Y[2] = X[2] + (float)rand()/RAND_MAX - 0.5;
-    }
-    else
-    {
-        X[0] = X[0] + (float)rand()/RAND_MAX - 0.5;
-        X[1] = X[1] + (float)rand()/RAND_MAX - 0.5;
-        X[2] = X[2] + (float)rand()/RAND_MAX - 0.5;
-    }
+    uint32_t c[4] = { (uint32_t)gid, (uint32_t)pid, (uint32_t)nsteps, 0 };
+    uint32_t k[2] = { seed, 0 };
+    uint32_t r[4];
+    philox4x32(c, k, r);
+
+    if (!Y)
+        Y = X;
+    Y[0] = X[0] + (rng_uniform(r[0]) - 0.5f);
+    Y[1] = X[1] + (rng_uniform(r[1]) - 0.5f);
+    Y[2] = X[2] + (rng_uniform(r[2]) - 0.5f);
 
     return true;
 }
@@ -48,15 +54,13 @@ bool advect_brown(
 bool advect_rk1(
         const int *st,      // min. corner of block
         const int *sz,      // size (number of points) in block
-        const float **vec,  // vector field
+        const VecField &vec, // vector field
         float *X,           // input point
         float h,            // step size
         float *Y = NULL)    // output point if not NULL, otherwise in X
 {
-    if (!inside(3, st, sz, X)) return false;
-
     float v[3];
-    if (!lerp3D(X, st, sz, 3, vec, v))
+    if (!lerp3D(X, st, sz, vec, v))
         return false;
 
     if (Y)
@@ -78,7 +82,7 @@ bool advect_rk1(
 bool advect_rk4(
         const int *st,      // min. corner of block
         const int *sz,      // size (number of points) in block
-        const float **vec,  // vector field
+        const VecField &vec, // vector field
         float *pt,          // input point
         float h,            // step size
         float* Y)           // output point
@@ -91,7 +95,7 @@ bool advect_rk4(
     float v[num_dims];
 
     // 1st rk step
-    if (!lerp3D(pt, st, sz, 3, vec, v))
+    if (!lerp3D(pt, st, sz, vec, v))
         return false;
     float k1[num_dims];
     for (int i = 0; i < num_dims; i++)
@@ -100,7 +104,7 @@ bool advect_rk4(
         Y[i] = p0[i] + 0.5 * k1[i];
 
     // 2nd rk step
-    if (!lerp3D(Y, st, sz, 3, vec, v))
+    if (!lerp3D(Y, st, sz, vec, v))
         return true;
     float k2[num_dims];
     for (int i = 0; i < num_dims; i++)
@@ -109,7 +113,7 @@ bool advect_rk4(
         Y[i] = Y[i] + 0.5 * k2[i];
 
     // 3rd rk step
-    if (!lerp3D(Y, st, sz, 3, vec, v))
+    if (!lerp3D(Y, st, sz, vec, v))
         return true;
     float k3[num_dims];
     for (int i = 0; i < num_dims; i++)
@@ -118,7 +122,7 @@ bool advect_rk4(
         Y[i] = Y[i] + k3[i];
 
     // 4th rk step
-    if (!lerp3D(Y, st, sz, 3, vec, v))
+    if (!lerp3D(Y, st, sz, vec, v))
         return true;
     for (int i = 0; i < num_dims; i++)
         Y[i] = Y[i] + (k1[i] + 2.0 * (k2[i] + k3[i]) + h * v[i]) / 6.0;
@@ -126,6 +130,367 @@ bool advect_rk4(
     return true;
 }
 
+// embedded Runge-Kutta-Fehlberg 4(5) step with error control
+// the step is advanced with the 5th order solution (local extrapolation) and the difference
+// to the 4th order solution estimates the error; the step size is adapted so that the error
+// per step stays below tol
+// a step whose intermediate points leave the block is retried with half the step size, down to
+// h_min, at which point a forward Euler step is taken, so that like advect_rk1, a particle
+// inside the block always advances and ends up in a neighbor when it leaves
+// returns false only if X is outside the block
+bool advect_rk45(
+        const int *st,      // min. corner of block
+        const int *sz,      // size (number of points) in block
+        const VecField &vec, // vector field
+        float *X,           // input point
+        float *h,           // input: trial step size; output: step size for the next step
+        float tol,          // error tolerance per step (grid units)
+        float h_min,        // min. step size
+        float h_max,        // max. step size
+        float *Y,           // output point
+        CellCache *cache,   // optional cell cache (see lerp.hpp)
+        int slot,           // cache slot
+        bool check)         // false: all stage points of steps up to h_max are known to be inside
+{
+    // Fehlberg coefficients
+    static const float a[6][5] =
+    {
+        { 0.0,              0.0,                0.0,                0.0,                0.0     },
+        { 1.0 / 4,          0.0,                0.0,                0.0,                0.0     },
+        { 3.0 / 32,         9.0 / 32,           0.0,                0.0,                0.0     },
+        { 1932.0 / 2197,    -7200.0 / 2197,     7296.0 / 2197,      0.0,                0.0     },
+        { 439.0 / 216,      -8.0,               3680.0 / 513,       -845.0 / 4104,      0.0     },
+        { -8.0 / 27,        2.0,                -3544.0 / 2565,     1859.0 / 4104,      -11.0 / 40 },
+    };
+    static const float b5[6] = { 16.0 / 135, 0.0, 6656.0 / 12825, 28561.0 / 56430, -9.0 / 50, 2.0 / 55 };
+    static const float e[6]  = { 1.0 / 360, 0.0, -128.0 / 4275, -2197.0 / 75240, 1.0 / 50, 2.0 / 55 };  // b5 - b4
 
+    float k[6][3];                          // velocity at each stage
+    float P[3];                             // stage point
+    float hh = *h;
+    if (hh < h_min) hh = h_min;
+    if (hh > h_max) hh = h_max;
+    float h0 = hh;                          // trial step before any shrinking at the block boundary
+    bool clipped = false;                   // step was shrunk only to keep stage points in the block
 
+    if (!lerp3D(X, st, sz, vec, k[0], cache, slot, check))
+        return false;
+
+    while (true)
+    {
+        // remaining stages
+        int s;
+        for (s = 1; s < 6; s++)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                float dx = 0.0;
+                for (int j = 0; j < s; j++)
+                    dx += a[s][j] * k[j][i];
+                P[i] = X[i] + hh * dx;
+            }
+            if (!lerp3D(P, st, sz, vec, k[s], cache, slot, check))
+                break;
+        }
 
+        if (s < 6)                          // a stage point left the block
+        {
+            if (hh > h_min)
+            {
+                hh = hh * 0.5 > h_min ? hh * 0.5 : h_min;
+                clipped = true;
+                continue;
+            }
+            for (int i = 0; i < 3; i++)     // forward Euler fallback
+                Y[i] = X[i] + hh * k[0][i];
+            *h = h0;                        // boundary shrinking does not carry over to the next block
+            return true;
+        }
+
+        // error estimate, max. norm
+        float err = 0.0;
+        for (int i = 0; i < 3; i++)
+        {
+            float d = 0.0;
+            for (int j = 0; j < 6; j++)
+                d += e[j] * k[j][i];
+            d = fabs(hh * d);
+            if (d > err)
+                err = d;
+        }
+
+        if (err > tol && hh > h_min)        // reject and retry with a smaller step
+        {
+            float f = 0.9 * pow(tol / err, 0.25);
+            hh = hh * (f > 0.1 ? f : 0.1);
+            if (hh < h_min) hh = h_min;
+            h0 = hh;
+            clipped = false;
+            continue;
+        }
+
+        // accept
+        for (int i = 0; i < 3; i++)
+        {
+            float dx = 0.0;
+            for (int j = 0; j < 6; j++)
+                dx += b5[j] * k[j][i];
+            Y[i] = X[i] + hh * dx;
+        }
+
+        // next step size
+        float f = err > 0.0 ? 0.9 * pow(tol / err, 0.2) : 5.0;
+        f = f < 0.2 ? 0.2 : (f > 5.0 ? 5.0 : f);
+        hh *= f;
+        if (clipped && hh < h0)
+            hh = h0;
+        *h = hh < h_min ? h_min : (hh > h_max ? h_max : hh);
+        return true;
+    }
+}
+
+// advances one chunk of n <= PACKET_SIZE lanes of a packet
+static int advect_rk1_packet_chunk(
+        const int *st,      // min. corner of block
+        const int *sz,      // size (number of points) in block
+        const VecField &vec, // vector field
+        int n,              // number of lanes
+        const float **X,    // input points, SoA
+        float h,            // step size
+        float **Y,          // output points, SoA
+        char *active,       // lane mask
+        CellCache *cache,   // optional cell cache
+        bool check)         // bounds checks
+{
+    float   v[3][PACKET_SIZE];
+    float*  vp[3] = { v[0], v[1], v[2] };
+    char    valid[PACKET_SIZE];
+
+    // lerp3D_packet interpolates only the lanes in valid, and clears those outside the block
+    // unless check is false
+    memcpy(valid, active, n);
+    lerp3D_packet(n, X, st, sz, vec, vp, valid, cache, check);
+
+    int nactive = 0;
+    for (int l = 0; l < n; l++)
+    {
+        active[l] = valid[l];
+        nactive += active[l];
+    }
+
+    for (int d = 0; d < 3; d++)
+        for (int l = 0; l < n; l++)
+            if (active[l])
+                Y[d][l] = X[d][l] + h * v[d][l];
+
+    return nactive;
+}
+
+int advect_rk1_packet(
+        const int *st,      // min. corner of block
+        const int *sz,      // size (number of points) in block
+        const VecField &vec, // vector field
+        int n,              // number of lanes
+        float * const *X,   // input points, SoA
+        float h,            // step size
+        float * const *Y,   // output points, SoA, may be X
+        char *active,       // lane mask
+        CellCache *cache,   // optional cell cache (see lerp.hpp)
+        bool check)         // bounds checks
+{
+    int nactive = 0;
+    for (int o = 0; o < n; o += PACKET_SIZE)
+    {
+        const float*    Xo[3] = { X[0] + o, X[1] + o, X[2] + o };
+        float*          Yo[3] = { Y[0] + o, Y[1] + o, Y[2] + o };
+        int             no    = n - o < PACKET_SIZE ? n - o : PACKET_SIZE;
+        nactive += advect_rk1_packet_chunk(st, sz, vec, no, Xo, h, Yo, active + o, cache, check);
+    }
+    return nactive;
+}
+
+// advances one chunk of n <= PACKET_SIZE lanes of a packet
+// follows advect_rk4 exactly, including which stages are skipped when an intermediate point
+// leaves the block
+static int advect_rk4_packet_chunk(
+        const int *st,      // min. corner of block
+        const int *sz,      // size (number of points) in block
+        const VecField &vec, // vector field
+        int n,              // number of lanes
+        const float **X,    // input points, SoA
+        float h,            // step size
+        float **Y,          // output points, SoA
+        char *active,       // lane mask
+        CellCache *cache,   // optional cell cache
+        bool check)         // bounds checks
+{
+    float   p[3][PACKET_SIZE];                  // current stage point
+    float   v[3][PACKET_SIZE];
+    float   k1[3][PACKET_SIZE], k2[3][PACKET_SIZE], k3[3][PACKET_SIZE];
+    float*  pp[3] = { p[0], p[1], p[2] };
+    float*  vp[3] = { v[0], v[1], v[2] };
+    char    valid[PACKET_SIZE];
+    char    stage[PACKET_SIZE];                 // lanes still going through the rk stages
+
+    // 1st rk step
+    memcpy(valid, active, n);                   // interpolate only the lanes still in the stages
+    lerp3D_packet(n, X, st, sz, vec, vp, valid, cache, check);
+    int nactive = 0;
+    for (int l = 0; l < n; l++)
+    {
+        active[l] = valid[l];
+        stage[l]  = active[l];
+        nactive += active[l];
+    }
+    for (int d = 0; d < 3; d++)
+        for (int l = 0; l < n; l++)
+            if (stage[l])
+            {
+                k1[d][l] = h * v[d][l];
+                p[d][l]  = X[d][l] + 0.5 * k1[d][l];
+            }
+
+    // 2nd rk step
+    memcpy(valid, stage, n);
+    lerp3D_packet(n, pp, st, sz, vec, vp, valid, cache, check);
+    for (int d = 0; d < 3; d++)
+        for (int l = 0; l < n; l++)
+            if (valid[l])
+            {
+                k2[d][l] = h * v[d][l];
+                p[d][l]  = p[d][l] + 0.5 * k2[d][l];
+            }
+    for (int l = 0; l < n; l++)
+        stage[l] = valid[l];
+
+    // 3rd rk step
+    memcpy(valid, stage, n);
+    lerp3D_packet(n, pp, st, sz, vec, vp, valid, cache, check);
+    for (int d = 0; d < 3; d++)
+        for (int l = 0; l < n; l++)
+            if (valid[l])
+            {
+                k3[d][l] = h * v[d][l];
+                p[d][l]  = p[d][l] + k3[d][l];
+            }
+    for (int l = 0; l < n; l++)
+        stage[l] = valid[l];
+
+    // 4th rk step
+    memcpy(valid, stage, n);
+    lerp3D_packet(n, pp, st, sz, vec, vp, valid, cache, check);
+    for (int d = 0; d < 3; d++)
+        for (int l = 0; l < n; l++)
+            if (valid[l])
+                p[d][l] = p[d][l] + (k1[d][l] + 2.0 * (k2[d][l] + k3[d][l]) + h * v[d][l]) / 6.0;
+
+    for (int d = 0; d < 3; d++)
+        for (int l = 0; l < n; l++)
+            if (active[l])
+                Y[d][l] = p[d][l];
+
+    return nactive;
+}
+
+int advect_rk4_packet(
+        const int *st,      // min. corner of block
+        const int *sz,      // size (number of points) in block
+        const VecField &vec, // vector field
+        int n,              // number of lanes
+        float * const *X,   // input points, SoA
+        float h,            // step size
+        float * const *Y,   // output points, SoA, may be X
+        char *active,       // lane mask
+        CellCache *cache,   // optional cell cache (see lerp.hpp)
+        bool check)         // bounds checks
+{
+    int nactive = 0;
+    for (int o = 0; o < n; o += PACKET_SIZE)
+    {
+        const float*    Xo[3] = { X[0] + o, X[1] + o, X[2] + o };
+        float*          Yo[3] = { Y[0] + o, Y[1] + o, Y[2] + o };
+        int             no    = n - o < PACKET_SIZE ? n - o : PACKET_SIZE;
+        nactive += advect_rk4_packet_chunk(st, sz, vec, no, Xo, h, Yo, active + o, cache, check);
+    }
+    return nactive;
+}
+
+int advect_rk45_packet(
+        const int *st,      // min. corner of block
+        const int *sz,      // size (number of points) in block
+        const VecField &vec, // vector field
+        int n,              // number of lanes
+        float * const *X,   // input points, SoA
+        float *h,           // per-lane step size, updated to the next step size
+        float tol,          // error tolerance per step (grid units)
+        float h_min,        // min. step size
+        float h_max,        // max. step size
+        float * const *Y,   // output points, SoA, may be X
+        char *active,       // lane mask
+        CellCache *cache,   // optional cell cache (see lerp.hpp)
+        bool check)         // bounds checks
+{
+    // the adaptive step sizes diverge between lanes, so each lane is stepped on its own
+    int nactive = 0;
+    for (int l = 0; l < n; l++)
+    {
+        if (!active[l])
+            continue;
+        float p[3] = { X[0][l], X[1][l], X[2][l] };
+        float q[3];
+        active[l] = advect_rk45(st, sz, vec, p, &h[l], tol, h_min, h_max, q, cache, l % CELL_CACHE_LANES,
+                                check);
+        if (active[l])
+        {
+            Y[0][l] = q[0];
+            Y[1][l] = q[1];
+            Y[2][l] = q[2];
+            nactive++;
+        }
+    }
+    return nactive;
+}
+
+int advect_brown_packet(
+        const int *st,      // min. corner of block
+        const int *sz,      // size (number of points) in block
+        const VecField &vec, // vector field
+        int n,              // number of lanes
+        float * const *X,   // input points, SoA
+        float h,            // step size
+        float * const *Y,   // output points, SoA, may be X
+        char *active,       // lane mask
+        const uint32_t * const *ids, // gid, pid, nsteps of the particle in each lane, SoA
+        unsigned seed,      // random seed
+        bool check)         // bounds checks
+{
+    uint32_t    k[2] = { seed, 0 };
+    uint32_t    r[4][PACKET_SIZE];
+    uint32_t*   rp[4] = { r[0], r[1], r[2], r[3] };
+
+    int nactive = 0;
+    for (int o = 0; o < n; o += PACKET_SIZE)
+    {
+        int             no    = n - o < PACKET_SIZE ? n - o : PACKET_SIZE;
+        const uint32_t* c[3]  = { ids[0] + o, ids[1] + o, ids[2] + o };
+
+        // random numbers of all lanes at once, same as advect_brown lane by lane
+        philox4x32_packet(no, c, k, rp);
+
+        for (int l = 0; l < no; l++)
+        {
+            if (!active[o + l])
+                continue;
+            float p[3] = { X[0][o + l], X[1][o + l], X[2][o + l] };
+            if (check && !inside(3, st, sz, p))
+            {
+                active[o + l] = 0;
+                continue;
+            }
+            for (int d = 0; d < 3; d++)
+                Y[d][o + l] = p[d] + (rng_uniform(r[d][l]) - 0.5f);
+            nactive++;
+        }
+    }
+    return nactive;
+}
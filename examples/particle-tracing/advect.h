@@ -16,12 +16,17 @@
 #define _ADVECT_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <cstddef>
 #include <functional>
 
+struct VecField;
+struct CellCache;
+
 bool advect_rk1(
         const int   *st,
         const int   *sz,
-        const float **vec,
+        const VecField &vec,
         float       *X,
         float        h,
         float       *Y);
@@ -29,18 +34,105 @@ bool advect_rk1(
 bool advect_brown(
         const int   *st,
         const int   *sz,
-        const float **vec,
+        const VecField &vec,
         float       *X,
         float        h,
-        float       *Y);
+        float       *Y,
+        int         gid,
+        int         pid,
+        int         nsteps,
+        unsigned    seed);
 
 
 bool advect_rk4(
         const int   *st,
         const int   *sz,
-        const float **vec,
+        const VecField &vec,
         float       *pt,
         float       h,
         float       *Y );
 
+bool advect_rk45(
+        const int   *st,
+        const int   *sz,
+        const VecField &vec,
+        float       *X,
+        float       *h,
+        float       tol,
+        float       h_min,
+        float       h_max,
+        float       *Y,
+        CellCache   *cache = NULL,
+        int         slot = 0,
+        bool        check = true);
+
+// packet (batched) integrators
+//
+// advance n particles in structure-of-arrays form, (X[0][l], X[1][l], X[2][l]) for lane l,
+// by one step into Y (Y may be the same arrays as X)
+// active[l] is the lane mask: on input, only active lanes are advanced; on output, lanes
+// whose particle could not be advanced (left the block) are cleared and their Y is untouched
+// results per lane are identical to the scalar advect_rk1 / advect_rk4
+// cache is an optional CellCache for the interpolations, lane l using slot l % CELL_CACHE_LANES
+// check = false skips the bounds checks: the caller guarantees that every point the step
+// interpolates at is inside the block, so that no lane can leave (see lerp3D_packet)
+// returns the number of lanes still active
+
+const int PACKET_SIZE = 64;             // number of lanes processed together by the packet integrators
+
+int advect_rk1_packet(
+        const int   *st,
+        const int   *sz,
+        const VecField &vec,
+        int         n,
+        float       * const *X,
+        float       h,
+        float       * const *Y,
+        char        *active,
+        CellCache   *cache = NULL,
+        bool        check = true);
+
+int advect_rk4_packet(
+        const int   *st,
+        const int   *sz,
+        const VecField &vec,
+        int         n,
+        float       * const *X,
+        float       h,
+        float       * const *Y,
+        char        *active,
+        CellCache   *cache = NULL,
+        bool        check = true);
+
+// adaptive version: h[l] is the per-lane step size, updated to the next step size
+int advect_rk45_packet(
+        const int   *st,
+        const int   *sz,
+        const VecField &vec,
+        int         n,
+        float       * const *X,
+        float       *h,
+        float       tol,
+        float       h_min,
+        float       h_max,
+        float       * const *Y,
+        char        *active,
+        CellCache   *cache = NULL,
+        bool        check = true);
+
+// Brownian motion: ids[0][l], ids[1][l], ids[2][l] are gid, pid, nsteps of the particle in lane l;
+// results per lane are identical to advect_brown
+int advect_brown_packet(
+        const int   *st,
+        const int   *sz,
+        const VecField &vec,
+        int         n,
+        float       * const *X,
+        float       h,
+        float       * const *Y,
+        char        *active,
+        const uint32_t * const *ids,
+        unsigned    seed,
+        bool        check = true);
+
 #endif
@@ -42,6 +42,8 @@
 #include <pnetcdf.h>
 #include <iomanip>      // std::setprecision
 
+#include "lerp.hpp"
+
 typedef diy::DiscreteBounds            Bounds;
 typedef diy::RegularGridLink           RGLink;
 typedef diy::RegularDecomposer<Bounds> Decomposer;
@@ -57,16 +59,176 @@ static void handle_error(int status, int lineno)
 // the diy block
 struct Block
 {
-    Block() : nvecs(0), init(0), done(0) {}
+    Block() : vxyz(NULL), hxyz(NULL), nvecs(0), layout(SOA_LAYOUT), precision(FP32_PRECISION), max_vel(0.0),
+              init(0), done(0)
+    {
+        for (int i = 0; i < NUM_COUNTS; i++)
+            counts[i] = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            vel[i]    = NULL;
+            hvel[i]   = NULL;
+            vscale[i] = 1.0;
+            vbias[i]  = 0.0;
+        }
+    }
     ~Block()
     {
-        if (nvecs)
+        free_vel();
+    }
+
+    // allocate velocity storage for a block of dims_ grid points in the given layout and precision
+    // for INT16_PRECISION, set_range() must be called before set_vel()
+    void alloc_vel(const int* dims_, int layout_, int precision_ = FP32_PRECISION)
+    {
+        free_vel();
+        for (int i = 0; i < 3; i++)
+            dims[i] = dims_[i];
+        nvecs     = (size_t)dims[0] * dims[1] * dims[2];
+        layout    = layout_;
+        precision = precision_;
+        max_vel   = 0.0;
+        size_t n  = vel_size();
+        if (precision == FP32_PRECISION)
+        {
+            if (layout == AOS_LAYOUT)
+            {
+                vxyz = new float[n];
+                for (int i = 0; i < 3; i++)
+                    vel[i] = vxyz + i;
+                for (size_t j = 3; j < n; j += 4)   // pad
+                    vxyz[j] = 0.0;
+            }
+            else
+            {
+                for (int i = 0; i < 3; i++)
+                {
+                    vel[i] = new float[n];
+                    if (n > nvecs)              // partial bricks
+                        fill(vel[i], vel[i] + n, 0.0);
+                }
+            }
+        }
+        else                                    // zero-filled, including pad, partial bricks, and the
+        {                                       // extra value read by 32-bit gathers
+            if (layout == AOS_LAYOUT)
+            {
+                hxyz = new uint16_t[n + 1]();
+                for (int i = 0; i < 3; i++)
+                    hvel[i] = hxyz + i;
+            }
+            else
+            {
+                for (int i = 0; i < 3; i++)
+                    hvel[i] = new uint16_t[n + 1]();
+            }
+        }
+    }
+
+    void free_vel()
+    {
+        if (!nvecs)
+            return;
+        if (layout == AOS_LAYOUT)
+        {
+            delete[] vxyz;
+            delete[] hxyz;
+        }
+        else
         {
             for (int i = 0; i < 3; i++)
+            {
                 delete[] vel[i];
+                delete[] hvel[i];
+            }
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            vel[i]  = NULL;
+            hvel[i] = NULL;
+        }
+        vxyz  = NULL;
+        hxyz  = NULL;
+        nvecs = 0;
+    }
+
+    // number of values in each velocity array (the single interleaved one for AOS_LAYOUT)
+    size_t vel_size() const
+    {
+        return (layout == AOS_LAYOUT ? 4 : 1) * field_size(dims, layout);
+    }
+
+    // range of velocity component v for INT16_PRECISION: [lo, hi] is mapped onto [-32768, 32767]
+    void set_range(int v, float lo, float hi)
+    {
+        vscale[v] = (hi - lo) / 65535;
+        vbias[v]  = lo + 32768 * vscale[v];
+    }
+
+    // set velocity vector i, where i is the row-major index of the grid point, regardless of layout
+    // the velocity is rounded to the storage precision, and max_vel is updated with the stored value
+    void set_vel(size_t i, float vx, float vy, float vz)
+    {
+        VecField f = field();
+        int    x = i % dims[0];
+        int    y = (i / dims[0]) % dims[1];
+        int    z = i / ((size_t)dims[0] * dims[1]);
+        size_t j = f.offset(0, x) + f.offset(1, y) + f.offset(2, z);
+        float  v[3] = { vx, vy, vz };
+        for (int k = 0; k < 3; k++)
+        {
+            switch (precision)
+            {
+            case FP16_PRECISION:
+                hvel[k][j] = float_to_half(v[k]);
+                v[k]       = half_to_float(hvel[k][j]);
+                break;
+            case BF16_PRECISION:
+                hvel[k][j] = float_to_bf16(v[k]);
+                v[k]       = bf16_to_float(hvel[k][j]);
+                break;
+            case INT16_PRECISION:
+                hvel[k][j] = (uint16_t)quantize16(v[k], vscale[k], vbias[k]);
+                v[k]       = vbias[k] + vscale[k] * (float)(int16_t)hvel[k][j];
+                break;
+            default:
+                vel[k][j]  = v[k];
+                break;
+            }
+            if (!(fabs(v[k]) <= max_vel))     // a NaN rules out the check-free fast path
+                max_vel = std::isnan(v[k]) ? INFINITY : fabs(v[k]);
         }
     }
 
+    // vector field as seen by the interpolation kernels
+    VecField field() const
+    {
+        VecField f  = make_field(vel, dims, layout);
+        f.precision = precision;
+        for (int i = 0; i < 3; i++)
+        {
+            f.hptrs[i] = hvel[i];
+            f.scale[i] = vscale[i];
+            f.bias[i]  = vbias[i];
+        }
+        return f;
+    }
+
+    // bytes of trajectory storage (segments and summaries)
+    size_t trace_bytes() const
+    {
+        return segments.used_bytes() + summaries.size() * sizeof(ParticleSummary);
+    }
+
+    // bytes of velocity storage
+    size_t vel_bytes() const
+    {
+        if (!nvecs)
+            return 0;
+        return (layout == AOS_LAYOUT ? 1 : 3) * vel_size() *
+            (precision == FP32_PRECISION ? sizeof(float) : sizeof(uint16_t));
+    }
+
     static void* create()
     {
         return new Block;
@@ -79,25 +241,77 @@ struct Block
     {
         const Block* b = static_cast<const Block*>(b_);
         diy::save(bb, b->nvecs);
-        diy::save(bb, b->vel[0], b->nvecs);
-        diy::save(bb, b->vel[1], b->nvecs);
-        diy::save(bb, b->vel[2], b->nvecs);
+        if (b->nvecs)
+        {
+            diy::save(bb, b->dims, 3);
+            diy::save(bb, b->layout);
+            diy::save(bb, b->precision);
+            diy::save(bb, b->max_vel);
+            diy::save(bb, b->vscale, 3);
+            diy::save(bb, b->vbias, 3);
+            if (b->precision != FP32_PRECISION)
+            {
+                if (b->layout == AOS_LAYOUT)
+                    diy::save(bb, b->hxyz, b->vel_size());
+                else
+                {
+                    diy::save(bb, b->hvel[0], b->vel_size());
+                    diy::save(bb, b->hvel[1], b->vel_size());
+                    diy::save(bb, b->hvel[2], b->vel_size());
+                }
+            }
+            else if (b->layout == AOS_LAYOUT)
+                diy::save(bb, b->vxyz, b->vel_size());
+            else
+            {
+                diy::save(bb, b->vel[0], b->vel_size());
+                diy::save(bb, b->vel[1], b->vel_size());
+                diy::save(bb, b->vel[2], b->vel_size());
+            }
+        }
         diy::save(bb, b->init);
         diy::save(bb, b->done);
+        diy::save(bb, b->counts, NUM_COUNTS);
         // TODO: serialize vtk structures
     }
     static void load(void* b_, diy::BinaryBuffer& bb)
     {
         Block* b = static_cast<Block*>(b_);
-        diy::load(bb, b->nvecs);
-        b->vel[0] = new float[b->nvecs];
-        b->vel[1] = new float[b->nvecs];
-        b->vel[2] = new float[b->nvecs];
-        diy::load(bb, b->vel[0], b->nvecs);
-        diy::load(bb, b->vel[1], b->nvecs);
-        diy::load(bb, b->vel[2], b->nvecs);
+        size_t nvecs;
+        diy::load(bb, nvecs);
+        if (nvecs)
+        {
+            int dims[3], layout, precision;
+            diy::load(bb, dims, 3);
+            diy::load(bb, layout);
+            diy::load(bb, precision);
+            b->alloc_vel(dims, layout, precision);
+            diy::load(bb, b->max_vel);
+            diy::load(bb, b->vscale, 3);
+            diy::load(bb, b->vbias, 3);
+            if (b->precision != FP32_PRECISION)
+            {
+                if (b->layout == AOS_LAYOUT)
+                    diy::load(bb, b->hxyz, b->vel_size());
+                else
+                {
+                    diy::load(bb, b->hvel[0], b->vel_size());
+                    diy::load(bb, b->hvel[1], b->vel_size());
+                    diy::load(bb, b->hvel[2], b->vel_size());
+                }
+            }
+            else if (b->layout == AOS_LAYOUT)
+                diy::load(bb, b->vxyz, b->vel_size());
+            else
+            {
+                diy::load(bb, b->vel[0], b->vel_size());
+                diy::load(bb, b->vel[1], b->vel_size());
+                diy::load(bb, b->vel[2], b->vel_size());
+            }
+        }
         diy::load(bb, b->init);
         diy::load(bb, b->done);
+        diy::load(bb, b->counts, NUM_COUNTS);
         // TODO: serialize vtk structures
     }
 
@@ -117,13 +331,31 @@ struct Block
 
         fmt::print(stderr, "rank {} gid {} has {} segments\n", cp.master()->communicator().rank(), cp.gid(), segments.size());
 
+        vector<Pt> pts;
         for (size_t i = 0; i < segments.size(); i++)
         {
-            fprintf(stderr, "[pid %d  gid %d num_pts %ld]: ", segments[i].pid, segments[i].gid, segments[i].pts.size());
-            if (segments[i].pts.size())     // print only first and last point in segment (all points are too much)
-                fprintf(stderr, "[%.3f %.3f %.3f] ... [%.3f %.3f %.3f]\n ",segments[i].pts.front().coords[0], segments[i].pts.front().coords[1], segments[i].pts.front().coords[2],
-                        segments[i].pts.back().coords[0], segments[i].pts.back().coords[1], segments[i].pts.back().coords[2]);
+            fprintf(stderr, "[pid %d  gid %d num_pts %ld]: ", segments.pid[i], segments.gid[i], segments.npts(i));
+            segments.get(i, pts);
+            if (pts.size())                 // print only first and last point in segment (all points are too much)
+                fprintf(stderr, "[%.3f %.3f %.3f] ... [%.3f %.3f %.3f]\n ",pts.front().coords[0], pts.front().coords[1], pts.front().coords[2],
+                        pts.back().coords[0], pts.back().coords[1], pts.back().coords[2]);
+        }
+    }
+
+    // one line per finished particle: pid gid seed point, end point, arc length, steps, exit reason
+    void write_summaries(std::string filename)
+    {
+        ofstream f;
+        f.open(filename);
+        for (size_t i = 0; i < summaries.size(); i++)
+        {
+            const ParticleSummary& s = summaries[i];
+            f << s.pid << " " << s.gid << " " << std::setprecision(8) <<
+                s.seed.coords[0] << " " << s.seed.coords[1] << " " << s.seed.coords[2] << " " <<
+                s.end.coords[0]  << " " << s.end.coords[1]  << " " << s.end.coords[2]  << " " <<
+                s.len << " " << s.nsteps << " " << s.reason << endl;
         }
+        f.close();
     }
 
     void write_segments(std::string filename)
@@ -134,13 +366,15 @@ struct Block
         // debug
 //         fmt::print("writing {} segments\n", segments.size());
 
+        vector<Pt> pts;
         for (size_t i = 0; i < segments.size(); i++)
         {
-            for (size_t j = 0; j < segments[i].pts.size(); j++)
+            segments.get(i, pts);           // decodes the compact form
+            for (size_t j = 0; j < pts.size(); j++)
             {
                 // debug
-//                 fprintf(f, "%ld %f %f %f, ", segments[i].pts.size(), segments[i].pts[0].coords[0], segments[i].pts[0].coords[1], segments[i].pts[0].coords[2]);
-                f << std::setprecision(8) << segments[i].pts[j].coords[0] << " " << segments[i].pts[j].coords[1] << " " << segments[i].pts[j].coords[2] << " ";
+//                 fprintf(f, "%ld %f %f %f, ", segments.npts(i), pts[0].coords[0], pts[0].coords[1], pts[0].coords[2]);
+                f << std::setprecision(8) << pts[j].coords[0] << " " << pts[j].coords[1] << " " << pts[j].coords[2] << " ";
             }
             f << endl;
         }
@@ -161,18 +395,22 @@ struct Block
         size_t n = 0;           // index of current point in all points in all traces
 
         // add points from each trace to one global list of vtkPoints
+        vector<Pt> pts;
         for (size_t i = 0; i < segments.size(); i++)
-            for (size_t j = 0; j < segments[i].pts.size(); j++)
-                points->InsertNextPoint(&(segments[i].pts[j].coords[0])); // deep copy, I assume?
+        {
+            segments.get(i, pts);
+            for (size_t j = 0; j < pts.size(); j++)
+                points->InsertNextPoint(&(pts[j].coords[0])); // deep copy, I assume?
+        }
 
         // create a polyline from each trace and a cell from each polyline
         for (size_t i = 0; i < segments.size(); i++)
         {
             // vtk polyline
             vtkSmartPointer<vtkPolyLine> polyLine = vtkSmartPointer<vtkPolyLine>::New();
-            polyLine->GetPointIds()->SetNumberOfIds(segments[i].pts.size());
+            polyLine->GetPointIds()->SetNumberOfIds(segments.npts(i));
 
-            for(unsigned int j = 0; j < segments[i].pts.size(); j++)
+            for(unsigned int j = 0; j < segments.npts(i); j++)
                 // map index of point in the streamline to point in points geometry
                 // setId(id of point in this streamline, id of point in all points)
                 polyLine->GetPointIds()->SetId(j, n++);
@@ -224,11 +462,23 @@ struct Block
 
 #endif
 
-    float                *vel[3];            // pointers to vx, vy, vz arrays (v[0], v[1], v[2])
+    float                *vel[3];            // pointers to vx, vy, vz arrays (v[0], v[1], v[2]), or into vxyz
+    float                *vxyz;              // interleaved x, y, z, pad velocities (AOS_LAYOUT only)
+    uint16_t             *hvel[3];           // same as vel, vxyz for 16-bit precision
+    uint16_t             *hxyz;
+    float                vscale[3];          // INT16_PRECISION: velocity = vbias + vscale * q
+    float                vbias[3];
     size_t               nvecs;              // number of velocity vectors
+    int                  dims[3];            // number of grid points in each dim (block bounds)
+    int                  layout;             // storage layout of the velocities (VecLayout)
+    int                  precision;          // storage precision of the velocities (VecPrecision)
+    float                max_vel;            // max. magnitude of any stored velocity component
     int                  init, done;         // initial and done flags
-    vector<Segment>      segments;           // finished segments of particle traces
-    vector<EndPt>        particles;
+    size_t               counts[NUM_COUNTS]; // TraceCount counters of the current trial
+    SegmentStore         segments;           // finished segments of particle traces
+    vector<ParticleSummary> summaries;       // finished particles (endpoint mode only)
+    ParticlePool         particles;          // particles to be traced in the current round
+    map<diy::BlockID, HeldEndPts> held;      // outgoing end points being coalesced (iexchange)
 
 #ifdef WITH_VTK
     vtkNew<vtkPoints>    points;             // points to be traced
@@ -269,12 +519,16 @@ struct AddAndRead : public AddBlock
                const char*  infile_,
                diy::mpi::communicator& world_,
                const float vec_scale_,
-               const int hdr_bytes_) :
+               const int hdr_bytes_,
+               const int layout_,
+               const int precision_) :
         AddBlock(m),
         infile(infile_),
         world(world_),
         vec_scale(vec_scale_),
-        hdr_bytes(hdr_bytes_) {}
+        hdr_bytes(hdr_bytes_),
+        layout(layout_),
+        precision(precision_) {}
 
     void operator()(int gid,
                     const Bounds& core,
@@ -334,11 +588,10 @@ struct AddAndRead : public AddBlock
         //        std::cout<<"counts"<<count[0]<<" "<<count[1]<<" "<<count[2]<<"\n";
         //        std::cout<<"starts"<<start[0]<<" "<<start[1]<<" "<<start[2]<<"\n";
 
-        size_t nvecs =
-                (bounds.max[0] - bounds.min[0] + 1) *
-                (bounds.max[1] - bounds.min[1] + 1) *
-                (bounds.max[2] - bounds.min[2] + 1);
-        vector<float> values(nvecs * 3); // temporary contiguous buffer of input vector values
+        int dims[3] = { bounds.max[0] - bounds.min[0] + 1,
+                        bounds.max[1] - bounds.min[1] + 1,
+                        bounds.max[2] - bounds.min[2] + 1 };
+        size_t nvecs = (size_t)dims[0] * dims[1] * dims[2];
 
         data_u = (float*) calloc(nvecs, sizeof(float));
         data_v = (float*) calloc(nvecs, sizeof(float));
@@ -353,18 +606,26 @@ struct AddAndRead : public AddBlock
 
 
         // copy from temp values into block
-        b->vel[0] = new float[nvecs];
-        b->vel[1] = new float[nvecs];
-        b->vel[2] = new float[nvecs];
-        b->nvecs = nvecs;
-        for (size_t i = 0; i < nvecs; i++)
+        // for the bricked layout, the bricks are built here once from the row-major input
+        // for 16-bit precision, the velocities are converted here once
+        b->alloc_vel(dims, layout, precision);
+        if (precision == INT16_PRECISION)
         {
-
-            b->vel[0][i] = data_u[i] * vec_scale;
-            b->vel[1][i] = data_v[i] * vec_scale;
-            b->vel[2][i] = data_w[i] * vec_scale;
-
+            float* data[3] = { data_u, data_v, data_w };
+            for (int k = 0; k < 3; k++)
+            {
+                float lo = data[k][0] * vec_scale, hi = lo;
+                for (size_t i = 1; i < nvecs; i++)
+                {
+                    float v = data[k][i] * vec_scale;
+                    lo = v < lo ? v : lo;
+                    hi = v > hi ? v : hi;
+                }
+                b->set_range(k, lo, hi);
+            }
         }
+        for (size_t i = 0; i < nvecs; i++)
+            b->set_vel(i, data_u[i] * vec_scale, data_v[i] * vec_scale, data_w[i] * vec_scale);
 
         ret = ncmpi_close(ncfile);
         free(start);
@@ -379,6 +640,8 @@ struct AddAndRead : public AddBlock
     diy::mpi::communicator world;
     float vec_scale;
     int hdr_bytes;
+    int layout;                         // storage layout of the velocities (VecLayout)
+    int precision;                      // storage precision of the velocities (VecPrecision)
 };
 
 // convert linear domain point index into (i,j,k,...) multidimensional index
@@ -407,11 +670,15 @@ struct AddConsistentSynthetic : public AddBlock
     AddConsistentSynthetic(diy::Master&  m,
                  const float             slow_vel_,             // slow velocity
                  const float             fast_vel_,             // fast velocity
-                 const size_t            tot_nslow_regions_) :  // total number of slow regions in global domain
+                 const size_t            tot_nslow_regions_,    // total number of slow regions in global domain
+                 const int               layout_,               // storage layout of the velocities
+                 const int               precision_) :          // storage precision of the velocities
         AddBlock(m),
         slow_vel(slow_vel_),
         fast_vel(fast_vel_),
-        tot_nslow_regions(tot_nslow_regions_) {}
+        tot_nslow_regions(tot_nslow_regions_),
+        layout(layout_),
+        precision(precision_) {}
 
     void operator()(int gid,
                     const Bounds& core,
@@ -421,14 +688,14 @@ struct AddConsistentSynthetic : public AddBlock
     {
         Block* b = AddBlock::operator()(gid, core, bounds, domain, link);
 
-        b->nvecs =                                  // total number of vectors in the block
-                (bounds.max[0] - bounds.min[0] + 1) *
-                (bounds.max[1] - bounds.min[1] + 1) *
-                (bounds.max[2] - bounds.min[2] + 1);
-
-        b->vel[0] = new float[b->nvecs];
-        b->vel[1] = new float[b->nvecs];
-        b->vel[2] = new float[b->nvecs];
+        int dims[3] = { bounds.max[0] - bounds.min[0] + 1,     // number of vectors in the block in each dim
+                        bounds.max[1] - bounds.min[1] + 1,
+                        bounds.max[2] - bounds.min[2] + 1 };
+        b->alloc_vel(dims, layout, precision);
+        float lo = min(min(slow_vel, fast_vel), 0.0f);
+        float hi = max(max(slow_vel, fast_vel), 0.0f);
+        for (int k = 0; k < 3; k++)
+            b->set_range(k, lo, hi);
 
         int dim = domain.min.size();
         vector<size_t>  ijk(dim);                   // coordinates of input point in global domain
@@ -474,12 +741,7 @@ struct AddConsistentSynthetic : public AddBlock
             }
 
             // set the velocity
-            if (slow_region)
-                b->vel[0][i] = slow_vel;
-            else
-                b->vel[0][i] = fast_vel;
-            b->vel[1][i] = 0.0;
-            b->vel[2][i] = 0.0;
+            b->set_vel(i, slow_region ? slow_vel : fast_vel, 0.0, 0.0);
 
             // debug
 //             if (slow_region)
@@ -494,5 +756,7 @@ struct AddConsistentSynthetic : public AddBlock
 
     float       slow_vel, fast_vel;     // slow and fast velocities
     size_t      tot_nslow_regions;      // total number of slow regions in the global domain
+    int         layout;                 // storage layout of the velocities (VecLayout)
+    int         precision;              // storage precision of the velocities (VecPrecision)
 };
 
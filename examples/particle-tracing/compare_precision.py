@@ -0,0 +1,84 @@
+'''
+Script for reporting the accuracy of traces computed with reduced-precision velocity storage
+(--precision 1, 2, or 3) against traces computed with float velocities (--precision 0).
+
+Both files are the output of --check (exchange.txt or iexchange.txt), renamed after each run:
+
+mpiexec -n 4 ./ptrace --check 1 --precision 0 <args> && mv exchange.txt fp32.txt
+mpiexec -n 4 ./ptrace --check 1 --precision 1 <args> && mv exchange.txt fp16.txt
+python compare_precision.py fp32.txt fp16.txt
+
+Each line of a file is one segment. The segments are chained into whole trajectories (a
+segment continues the trajectory whose last point is its first point) and the trajectories
+are matched by seed point. Reported are the distance between corresponding points, the
+distance between the end points, and the difference in number of points.
+
+'''
+
+import sys
+import math
+
+def read_trajectories(fname):
+    segs = []
+    with open(fname) as f:
+        for ln in f:
+            v = ln.split()
+            if len(v) >= 3:
+                segs.append([tuple(v[i : i + 3]) for i in range(0, len(v) - 2, 3)])
+
+    # chain the segments: the first point of a continuing segment is the last point of the previous one
+    by_start = {}
+    for s in segs:
+        by_start.setdefault(s[0], []).append(s)
+    ends = {}
+    for s in segs:
+        if len(s) > 1:
+            ends[s[-1]] = ends.get(s[-1], 0) + 1
+    trajs = {}
+    for s in segs:
+        if ends.get(s[0], 0):
+            continue                                    # continues another segment
+        t = list(s)
+        while len(t) > 1 and by_start.get(t[-1]):
+            nxt = by_start[t[-1]].pop()
+            t.extend(nxt[1:])
+        trajs[s[0]] = [tuple(float(c) for c in p) for p in t]
+    return trajs
+
+def dist(p, q):
+    return math.sqrt(sum((a - b) * (a - b) for a, b in zip(p, q)))
+
+fname_ref = sys.argv[1] if len(sys.argv) > 1 else "./fp32.txt"
+fname_red = sys.argv[2] if len(sys.argv) > 2 else "./exchange.txt"
+
+ref = read_trajectories(fname_ref)
+red = read_trajectories(fname_red)
+
+seeds = [s for s in ref if s in red]
+if not seeds:
+    print("No matching trajectories")
+    sys.exit(1)
+
+max_pt = 0.0                    # max. distance between corresponding points
+sum_pt = 0.0                    # sum of distances between corresponding points
+npts   = 0
+end_d  = []                     # distance between end points of each trajectory
+len_d  = 0                      # trajectories with different number of points
+for s in seeds:
+    a = ref[s]
+    b = red[s]
+    for p, q in zip(a, b):
+        d = dist(p, q)
+        max_pt = max(max_pt, d)
+        sum_pt += d
+        npts += 1
+    end_d.append(dist(a[-1], b[-1]))
+    if len(a) != len(b):
+        len_d += 1
+end_d.sort()
+
+print("trajectories: %d reference, %d reduced precision, %d matched" % (len(ref), len(red), len(seeds)))
+print("point distance: mean %g max %g (grid units, over %d points)" % (sum_pt / npts, max_pt, npts))
+print("end point distance: mean %g median %g max %g" %
+      (sum(end_d) / len(end_d), end_d[len(end_d) // 2], end_d[-1]))
+print("trajectories with different number of points: %d" % len_d)
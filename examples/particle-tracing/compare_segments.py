@@ -1,5 +1,6 @@
 '''
-Script for comparing segments generated using iexchange and exchange.
+Script for comparing segments generated using iexchange and exchange
+(--check 1 with --exchange 1 and --exchange 0).
 
 '''
 
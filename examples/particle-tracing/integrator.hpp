@@ -0,0 +1,174 @@
+//---------------------------------------------------------------------------
+//
+// integrator policies for tracing packets of particles
+//
+// trace_particles() is templated on one of these policies, so that the integrator and the
+// per-lane bookkeeping specific to it (e.g., adaptive step sizes) are resolved at compile time;
+// the policy is picked at runtime from IntegratorParams, with one instantiation per integrator
+//
+// step() advances the active lanes of a packet by one step in place, with the same lane mask
+// convention as the packet integrators in advect.h, and returns the number of lanes still active
+// H[l] is the step size of lane l; only adaptive integrators read and update it
+// ids[0][l], ids[1][l], ids[2][l] are gid, pid, nsteps of the particle in lane l; only
+// stochastic integrators read them, to key their random numbers on the particle and step
+// cache is the cell cache of the packet for the interpolations, see lerp.hpp
+// check = false skips the bounds checks of the step, see below
+//
+// reach() bounds how far a step moves a particle in a field whose velocity components are at
+// most vmax in magnitude: each step moves each coordinate by at most R, and the points a step
+// interpolates at are within E of its start point in each coordinate, so the k-th step from a
+// point at distance d from the block boundary (k = 0, 1, ...) stays inside if k * R + E < d
+// and can be taken with check = false
+// for adaptive integrators, the bounds hold only for the next step, taken with step size h
+//
+//--------------------------------------------------------------------------
+
+#ifndef _INTEGRATOR_HPP
+#define _INTEGRATOR_HPP
+
+#include "advect.h"
+#include "lerp.hpp"
+
+class WorkerPool;
+
+enum IntegratorType
+{
+    RK1_INTEGRATOR      = 0,                // forward Euler
+    RK4_INTEGRATOR      = 1,                // classic 4th order Runge-Kutta
+    RK45_INTEGRATOR     = 2,                // adaptive Runge-Kutta-Fehlberg 4(5)
+    BROWN_INTEGRATOR    = 3,                // Brownian motion (random walk)
+    NUM_INTEGRATORS
+};
+
+// runtime integrator settings, and the tracing settings that go with them
+struct IntegratorParams
+{
+    int     type;                           // IntegratorType
+    float   h;                              // step size (initial step size if adaptive)
+    float   tol;                            // error tolerance per step (adaptive only)
+    float   h_min;                          // step size bounds (adaptive only)
+    float   h_max;
+    bool    cell_cache;                     // interpolate through a per-lane cell cache (see lerp.hpp)
+    bool    fast_path;                      // skip bounds checks for steps that cannot leave the block
+    bool    endpoints;                      // keep a ParticleSummary per particle instead of trajectories
+    int     decimate;                       // keep only every decimate-th trajectory point
+    float   simplify;                       // max. distance of dropped trajectory points to the polyline, 0 = off
+    unsigned seed;                          // random seed (stochastic only)
+    float   min_speed;                      // termination criteria (see trace_particles), 0 = off:
+    int     window;                         // min. speed, min. displacement over each window of steps,
+    float   min_disp;
+    int     cell_steps;                     // max. consecutive steps in one cell
+    bool    iexchange;                      // tracing in master.iexchange() callbacks, not in exchange rounds
+    size_t  step_budget;                    // max. particle steps per iexchange callback, 0 = unlimited
+    size_t  min_queue_size;                 // iexchange: bytes of end points to coalesce per neighbor,
+    size_t  max_hold_time;                  // or microseconds to hold them, before sending
+    bool    fine;                           // iexchange: send each end point as soon as it is known
+    float   wire_quantum;                   // quantization step of sent end point coordinates, 0 = float
+    bool    raw_endpts;                     // send end points as the arrays of the particle pool, see WIRE_RAW
+    bool    sort_particles;                 // sort the particles by cell before tracing them
+    bool    miss_counters;                  // count hardware cache misses while tracing
+    WorkerPool* workers;                    // threads for tracing the particles of a block, NULL = calling thread only
+};
+
+struct RK1Integrator
+{
+    static const bool adaptive   = false;
+    static const bool stochastic = false;
+
+    explicit RK1Integrator(const IntegratorParams& p) : h(p.h)  {}
+
+    int step(const int* st, const int* sz, const VecField& vec, int n,
+             float* const* X, float* H, const uint32_t* const* ids, char* active, CellCache* cache,
+             bool check) const
+    {
+        return advect_rk1_packet(st, sz, vec, n, X, h, X, active, cache, check);
+    }
+
+    void reach(float vmax, float h_, float& R, float& E) const
+    {
+        R = h * vmax;
+        E = 0.0;
+    }
+
+    float h;
+};
+
+struct RK4Integrator
+{
+    static const bool adaptive   = false;
+    static const bool stochastic = false;
+
+    explicit RK4Integrator(const IntegratorParams& p) : h(p.h)  {}
+
+    int step(const int* st, const int* sz, const VecField& vec, int n,
+             float* const* X, float* H, const uint32_t* const* ids, char* active, CellCache* cache,
+             bool check) const
+    {
+        return advect_rk4_packet(st, sz, vec, n, X, h, X, active, cache, check);
+    }
+
+    // the stage points of advect_rk4 are X + h/2 k1, + h/2 k2, + h k3, and the step ends at
+    // the last one + h/6 (k1 + 2 k2 + 2 k3 + k4)
+    void reach(float vmax, float h_, float& R, float& E) const
+    {
+        R = 3.0 * h * vmax;
+        E = 2.0 * h * vmax;
+    }
+
+    float h;
+};
+
+struct RK45Integrator
+{
+    static const bool adaptive   = true;
+    static const bool stochastic = false;
+
+    explicit RK45Integrator(const IntegratorParams& p) :
+        tol(p.tol), h_min(p.h_min), h_max(p.h_max)              {}
+
+    int step(const int* st, const int* sz, const VecField& vec, int n,
+             float* const* X, float* H, const uint32_t* const* ids, char* active, CellCache* cache,
+             bool check) const
+    {
+        return advect_rk45_packet(st, sz, vec, n, X, H, tol, h_min, h_max, X, active, cache, check);
+    }
+
+    // sums of the magnitudes of the Fehlberg coefficients, over the 5th order weights and over
+    // the stage with the largest ones; advect_rk45 clamps the step size and only shrinks it
+    // within a step
+    void reach(float vmax, float h_, float& R, float& E) const
+    {
+        float hh = h_ < h_min ? h_min : (h_ > h_max ? h_max : h_);
+        R = 1.361 * hh * vmax;
+        E = 17.412 * hh * vmax;
+    }
+
+    float tol, h_min, h_max;
+};
+
+struct BrownIntegrator
+{
+    static const bool adaptive   = false;
+    static const bool stochastic = true;
+
+    explicit BrownIntegrator(const IntegratorParams& p) : h(p.h), seed(p.seed)   {}
+
+    int step(const int* st, const int* sz, const VecField& vec, int n,
+             float* const* X, float* H, const uint32_t* const* ids, char* active, CellCache* cache,
+             bool check) const
+    {
+        return advect_brown_packet(st, sz, vec, n, X, h, X, active, ids, seed, check);
+    }
+
+    // random displacements in [-0.5, 0.5), independent of the velocity
+    void reach(float vmax, float h_, float& R, float& E) const
+    {
+        R = 0.5;
+        E = 0.0;
+    }
+
+    float    h;
+    unsigned seed;
+};
+
+#endif
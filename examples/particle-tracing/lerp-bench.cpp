@@ -0,0 +1,183 @@
+//---------------------------------------------------------------------------
+//
+// microbenchmark of trilinear interpolation in different velocity storage layouts
+//
+// traces packets of particles through one synthetic block in lockstep, the same way
+// trace_particles does, and reports the interpolation time per particle step for the
+// row-major, interleaved, and bricked layouts in each storage precision, without and with the
+// cell cache, with particles moving along x, y, z, or in random directions
+//
+// usage: lerp-bench [nx ny nz [nparticles [nsteps]]]
+// default block size is a 126 x 126 x 512 plume block
+//
+//--------------------------------------------------------------------------
+
+#include "lerp.hpp"
+#include "advect.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+// fill a block with a smooth synthetic velocity field in the given layout and precision
+void fill_field(const int*              dims,
+                int                     layout,
+                int                     precision,
+                vector<float>           (&storage)[3],
+                vector<uint16_t>        (&hstorage)[3],
+                VecField&               f)
+{
+    size_t n = (layout == AOS_LAYOUT ? 4 : 1) * field_size(dims, layout);
+    float*    ptrs[3];
+    uint16_t* hptrs[3];
+    for (int v = 0; v < 3; v++)
+    {
+        int a = layout == AOS_LAYOUT ? 0 : v;
+        if (v == a)
+        {
+            storage[v].assign(n, 0.0);
+            hstorage[v].assign(n + 1, 0);       // padded for 32-bit gathers, see VecField
+        }
+        ptrs[v]  = &storage[a][0] + (a == v ? 0 : v);
+        hptrs[v] = &hstorage[a][0] + (a == v ? 0 : v);
+    }
+    f = make_field(ptrs, dims, layout);
+    f.precision = precision;
+    for (int v = 0; v < 3; v++)
+    {
+        f.hptrs[v] = hptrs[v];
+        f.scale[v] = 4.0 / 65535;               // values are in [-2, 2] for the block sizes used here
+        f.bias[v]  = -2.0 + 32768 * f.scale[v];
+    }
+
+    for (int z = 0; z < dims[2]; z++)
+        for (int y = 0; y < dims[1]; y++)
+            for (int x = 0; x < dims[0]; x++)
+            {
+                int j = f.offset(0, x) + f.offset(1, y) + f.offset(2, z);
+                float val[3] = { (float)(sin(0.1 * y) + 0.001 * z),
+                                 (float)(cos(0.1 * z) + 0.001 * x),
+                                 (float)(sin(0.1 * x) + 0.001 * y) };
+                for (int v = 0; v < 3; v++)
+                {
+                    ptrs[v][j] = val[v];
+                    if (precision == FP16_PRECISION)
+                        hptrs[v][j] = float_to_half(val[v]);
+                    else if (precision == BF16_PRECISION)
+                        hptrs[v][j] = float_to_bf16(val[v]);
+                    else if (precision == INT16_PRECISION)
+                        hptrs[v][j] = quantize16(val[v], f.scale[v], f.bias[v]);
+                }
+            }
+}
+
+// time per particle step (ns) of interpolating packets of particles moving in direction dir
+// (random direction per particle if dir < 0)
+double bench(const int*         dims,
+             const VecField&    f,
+             int                dir,
+             int                nparticles,
+             int                nsteps,
+             bool               cached,
+             double&            hit_rate)
+{
+    const int   st[3] = { 0, 0, 0 };
+    mt19937     gen(0);
+    uniform_real_distribution<float> u(0.0, 1.0);
+
+    float       X[3][PACKET_SIZE], D[3][PACKET_SIZE], V[3][PACKET_SIZE];
+    float*      Xp[3] = { X[0], X[1], X[2] };
+    float*      Vp[3] = { V[0], V[1], V[2] };
+    char        valid[PACKET_SIZE];
+    double      sum   = 0.0;                    // keeps the results live
+    CellCache   cache;
+
+    auto t0 = chrono::high_resolution_clock::now();
+    for (int p = 0; p < nparticles; p += PACKET_SIZE)
+    {
+        for (int l = 0; l < PACKET_SIZE; l++)
+        {
+            for (int d = 0; d < 3; d++)
+            {
+                X[d][l] = u(gen) * (dims[d] - 1);
+                D[d][l] = dir < 0 ? u(gen) - 0.5 : (d == dir ? 1.0 : 0.0);
+            }
+            float len = sqrt(D[0][l] * D[0][l] + D[1][l] * D[1][l] + D[2][l] * D[2][l]);
+            for (int d = 0; d < 3; d++)
+                D[d][l] *= 0.5 / len;           // same step length as h = 0.5 with unit velocity
+        }
+        for (int s = 0; s < nsteps; s++)
+        {
+            memset(valid, 1, PACKET_SIZE);      // all lanes
+            lerp3D_packet(PACKET_SIZE, Xp, st, dims, f, Vp, valid, cached ? &cache : NULL);
+            for (int d = 0; d < 3; d++)
+                for (int l = 0; l < PACKET_SIZE; l++)
+                {
+                    sum     += valid[l] ? V[d][l] : 0.0;
+                    X[d][l] += D[d][l];         // wrap around to stay inside the block
+                    if (X[d][l] >= dims[d] - 1)
+                        X[d][l] -= dims[d] - 1;
+                    if (X[d][l] < 0)
+                        X[d][l] += dims[d] - 1;
+                }
+        }
+    }
+    auto t1 = chrono::high_resolution_clock::now();
+
+    if (sum == 0.123456)
+        fprintf(stderr, "%f\n", sum);
+    hit_rate = cache.hits ? (double)cache.hits / (cache.hits + cache.misses) : 0.0;
+    return chrono::duration<double, nano>(t1 - t0).count() / ((double)nparticles * nsteps);
+}
+
+int main(int argc, char** argv)
+{
+    int dims[3]    = { 126, 126, 512 };
+    int nparticles = 16384;
+    int nsteps     = 256;
+    if (argc >= 4)
+        for (int i = 0; i < 3; i++)
+            dims[i] = atoi(argv[i + 1]);
+    if (argc >= 5)
+        nparticles = atoi(argv[4]);
+    if (argc >= 6)
+        nsteps = atoi(argv[5]);
+
+    const char* layout_names[3] = { "row-major", "interleaved", "bricked" };
+    const char* prec_names[4]   = { "fp32", "fp16", "bf16", "int16" };
+    const char* dir_names[4]    = { "x", "y", "z", "random" };
+
+    fprintf(stderr, "block %d x %d x %d, %d particles x %d steps, packet width %d\n",
+            dims[0], dims[1], dims[2], nparticles, nsteps, lerp3D_packet_width());
+    fprintf(stderr, "ns per particle step:\n");
+    fprintf(stderr, "%-24s", "layout");
+    for (int d = 0; d < 4; d++)
+        fprintf(stderr, " %10s", dir_names[d]);
+    fprintf(stderr, "   cache hit rate x y z random\n");
+
+    for (int layout = SOA_LAYOUT; layout <= BRICK_LAYOUT; layout++)
+        for (int prec = FP32_PRECISION; prec <= INT16_PRECISION; prec++)
+        {
+            vector<float>       storage[3];
+            vector<uint16_t>    hstorage[3];
+            VecField            f;
+            fill_field(dims, layout, prec, storage, hstorage, f);
+
+            for (int cached = 0; cached < 2; cached++)
+            {
+                double hit_rate[4];
+                fprintf(stderr, "%-12s %-5s %-5s", layout_names[layout], prec_names[prec], cached ? "cache" : "");
+                for (int d = 0; d < 4; d++)
+                    fprintf(stderr, " %10.2f", bench(dims, f, d < 3 ? d : -1, nparticles, nsteps, cached, hit_rate[d]));
+                if (cached)
+                    fprintf(stderr, "   %.2f %.2f %.2f %.2f", hit_rate[0], hit_rate[1], hit_rate[2], hit_rate[3]);
+                fprintf(stderr, "\n");
+            }
+        }
+
+    return 0;
+}
@@ -16,9 +16,18 @@
 #define _LERP_HPP
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <cmath>
 #include <stdio.h>
 
+// x86 SIMD packet kernels are compiled with per-function target attributes and selected at
+// run time, so the rest of the code does not need to be built with -mavx2 or -mavx512f
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__)) && !defined(NO_SIMD)
+#define LERP_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 // inside excludes the boundary (changed by TP 10/11/19)
 inline bool inside(int              num_dims,
                    const int*       st,
@@ -26,7 +35,7 @@ inline bool inside(int              num_dims,
                    const float*     p)
 {
     for (int i = 0; i < num_dims; i++)
-        if (p[i] < (float)(st[i]) || p[i] >= (float)(st[i] + sz[i] - 1))
+        if (!(p[i] >= (float)(st[i]) && p[i] < (float)(st[i] + sz[i] - 1)))     // also for NaN
             return false;
     return true;
 }
@@ -140,6 +149,711 @@ inline bool lerp3D(const float*     pt,         // target point
     return true;
 }
 
+// storage layouts of the vector field of a block
+enum VecLayout
+{
+    SOA_LAYOUT   = 0,                       // separate vx, vy, vz arrays, row-major
+    AOS_LAYOUT   = 1,                       // one interleaved array of x, y, z, pad per grid point, row-major
+    BRICK_LAYOUT = 2,                       // separate vx, vy, vz arrays, each in row-major order of bricks
+                                            // of BRICK_SIZE^3 grid points, row-major inside each brick
+};
+
+const int BRICK_SHIFT = 2;                  // log2 of brick edge length
+const int BRICK_SIZE  = 1 << BRICK_SHIFT;   // brick edge length (grid points)
+
+// storage precision of the vector field of a block
+// 16-bit values are widened to float when they are loaded by the interpolation kernels
+enum VecPrecision
+{
+    FP32_PRECISION  = 0,                    // float
+    FP16_PRECISION  = 1,                    // IEEE half float, 11 significant bits, max. 65504
+    BF16_PRECISION  = 2,                    // bfloat16 (upper half of a float), 8 significant bits
+    INT16_PRECISION = 3,                    // int16 quantized with a per-block scale and offset per component
+};
+
+// float to IEEE half float, rounded to nearest even, overflows to infinity
+inline uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int      e    = (x >> 23) & 0xff;
+    uint32_t mant = x & 0x7fffff;
+    if (e == 0xff)                                      // inf, nan
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    e -= 127 - 15;                                      // rebias
+    if (e >= 31)                                        // overflow
+        return sign | 0x7c00;
+    int shift = 13;                                     // mantissa bits dropped
+    if (e <= 0)                                         // subnormal half
+    {
+        if (e < -10)
+            return sign;
+        mant  |= 0x800000;
+        shift  = 14 - e;
+        e      = 0;
+    }
+    uint32_t h    = ((uint32_t)e << 10) + (mant >> shift);
+    uint32_t rem  = mant & ((1u << shift) - 1);
+    uint32_t half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (h & 1)))         // carry may propagate into the exponent
+        h++;
+    return sign | h;
+}
+
+// IEEE half float to float, exact
+inline float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t e    = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if (e == 0x1f)                                      // inf, nan
+        x = sign | 0x7f800000 | (mant << 13);
+    else if (e)
+        x = sign | ((e + 127 - 15) << 23) | (mant << 13);
+    else if (mant)                                      // subnormal half, normal float
+    {
+        e = 127 - 14;
+        while (!(mant & 0x400))
+        {
+            mant <<= 1;
+            e--;
+        }
+        x = sign | (e << 23) | ((mant & 0x3ff) << 13);
+    }
+    else
+        x = sign;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// float to bfloat16, rounded to nearest even
+inline uint16_t float_to_bf16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000)                  // nan stays nan
+        return (x >> 16) | 0x40;
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+inline float bf16_to_float(uint16_t b)
+{
+    uint32_t x = (uint32_t)b << 16;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// quantized int16 q represents bias + scale * q
+inline int16_t quantize16(float f, float scale, float bias)
+{
+    if (scale == 0.0)
+        return 0;
+    float q = std::nearbyint((f - bias) / scale);
+    return q < -32768.0 ? -32768 : (q > 32767.0 ? 32767 : (int16_t)q);
+}
+
+// vector field of a block as seen by the interpolation kernels
+//
+// the storage index of a grid point is separable: component v of grid point (x, y, z) is
+// ptrs[v][offset(0, x) + offset(1, y) + offset(2, z)], which covers all layouts:
+//  - row-major: shift = 0 and offset(d, x) = x * bstride[d]
+//  - interleaved: same, with bstride scaled by 4, so the 8 corners of a cell cost at most
+//    8 cache lines instead of 24
+//  - bricked: the high bits of x select the brick and the low bits the point inside it, so
+//    that moving along y or z stays inside the same few cache lines / pages
+// with 16-bit precision the values are in hptrs instead of ptrs, at the same offsets; 16-bit
+// arrays are padded by one value, so that the SIMD kernels can gather them 32 bits at a time
+struct VecField
+{
+    const float*    ptrs[3];                // first value of vx, vy, vz
+    int             shift;                  // log2 of brick edge length, 0 if not bricked
+    int             bstride[3];             // distance between consecutive bricks (grid points if not bricked) in each dim
+    int             lstride[3];             // distance between consecutive grid points inside a brick
+    int             precision;              // storage precision (VecPrecision)
+    const uint16_t* hptrs[3];               // first value of vx, vy, vz if stored in 16 bits
+    float           scale[3];               // INT16_PRECISION: value = bias + scale * q
+    float           bias[3];
+
+    int offset(int d, int x) const
+    {
+        return (x >> shift) * bstride[d] + (x & ((1 << shift) - 1)) * lstride[d];
+    }
+
+    // component v at the 8 storage offsets o, widened to float
+    void corners(int v, const int* o, float* p) const
+    {
+        switch (precision)
+        {
+        case FP16_PRECISION:
+            for (int s = 0; s < 8; s++)
+                p[s] = half_to_float(hptrs[v][o[s]]);
+            break;
+        case BF16_PRECISION:
+            for (int s = 0; s < 8; s++)
+                p[s] = bf16_to_float(hptrs[v][o[s]]);
+            break;
+        case INT16_PRECISION:
+            for (int s = 0; s < 8; s++)
+                p[s] = bias[v] + scale[v] * (float)(int16_t)hptrs[v][o[s]];
+            break;
+        default:
+            for (int s = 0; s < 8; s++)
+                p[s] = ptrs[v][o[s]];
+            break;
+        }
+    }
+};
+
+// number of values stored per velocity component for a block of dims grid points
+// (for the interleaved layout, the single array holds 4 times this many values)
+inline size_t field_size(const int* dims, int layout)
+{
+    if (layout == BRICK_LAYOUT)
+    {
+        size_t n = 1;
+        for (int i = 0; i < 3; i++)
+            n *= (dims[i] + BRICK_SIZE - 1) >> BRICK_SHIFT;
+        return n << (3 * BRICK_SHIFT);
+    }
+    return (size_t)dims[0] * dims[1] * dims[2];
+}
+
+// vector field descriptor for velocities of a block of dims grid points stored in the given layout
+// for the interleaved layout, ptrs[v] points at component v of the first grid point
+inline VecField make_field(float* const* ptrs, const int* dims, int layout)
+{
+    VecField f = { { ptrs[0], ptrs[1], ptrs[2] }, 0, { 1, dims[0], dims[0] * dims[1] }, { 0, 0, 0 },
+                   FP32_PRECISION, { NULL, NULL, NULL }, { 1.0, 1.0, 1.0 }, { 0.0, 0.0, 0.0 } };
+    if (layout == AOS_LAYOUT)
+    {
+        for (int i = 0; i < 3; i++)
+            f.bstride[i] *= 4;
+    }
+    else if (layout == BRICK_LAYOUT)
+    {
+        int nb[2] = { (dims[0] + BRICK_SIZE - 1) >> BRICK_SHIFT,
+                      (dims[1] + BRICK_SIZE - 1) >> BRICK_SHIFT };
+        int bs    = 1 << (3 * BRICK_SHIFT);     // values per brick
+        f.shift      = BRICK_SHIFT;
+        f.bstride[0] = bs;
+        f.bstride[1] = bs * nb[0];
+        f.bstride[2] = bs * nb[0] * nb[1];
+        f.lstride[0] = 1;
+        f.lstride[1] = BRICK_SIZE;
+        f.lstride[2] = BRICK_SIZE * BRICK_SIZE;
+    }
+    return f;
+}
+
+// per-lane cache of the corner values of the cell each lane of a packet last interpolated in
+// with small steps, consecutive steps of a particle (and the stages of one rk step) mostly
+// stay in the same cell, so only lanes that moved to another cell load the 8 x 3 corner values
+// the cached values are widened to float and are exactly the values that would be loaded, so
+// results do not change; a cache is only valid for the vector field it was filled from
+const int CELL_CACHE_LANES = 64;            // number of lanes; lane l uses slot l % CELL_CACHE_LANES
+
+struct CellCache
+{
+    CellCache() : hits(0), misses(0)
+    {
+        for (int l = 0; l < CELL_CACHE_LANES; l++)
+            cell[0][l] = cell[1][l] = cell[2][l] = -1;
+    }
+
+    int     cell[3][CELL_CACHE_LANES];          // min corner of the cached cell relative to the block, -1 if none
+    float   corner[3][8][CELL_CACHE_LANES];     // component v at corner s
+    size_t  hits;                               // interpolations that used cached corners
+    size_t  misses;                             // interpolations that loaded the corners
+};
+
+// same as lerp3D, for any storage layout; results are identical to lerp3D on the same values
+// if cache is not NULL, the corner values are taken from / stored in its slot
+// if check is false, the point must be known to be inside the block
+inline bool lerp3D(const float*     pt,         // target point
+                   const int*       st,         // min corner of block
+                   const int*       sz,         // number of grid spaces in block
+                   const VecField&  vec,        // input vector field
+                   float*           vars,       // output interpolated vector at target point
+                   CellCache*       cache = NULL,
+                   int              slot  = 0,
+                   bool             check = true)
+{
+    if (check && !inside(3, st, sz, pt)) return false;
+
+    float p[8];                              // one component of velocity at each corner of texel
+    float x  = pt[0] - (float)(st[0]),       // physical coords of point relative to min. of block
+          y  = pt[1] - (float)(st[1]),
+          z  = pt[2] - (float)(st[2]);
+    int   i  = floor(x),                     // indices of min corner of texel containing point
+          j  = floor(y),
+          k  = floor(z);
+    int   i1 =i + 1,                         // indices of max corner of texel containing point
+          j1 =j + 1,
+          k1 =k + 1;
+    float x0 = i, x1 = i1,                   // float version of min, max corner of texel
+          y0 = j, y1 = j1,
+          z0 = k, z1 = k1;
+    int   ox = vec.offset(0, i), ox1 = vec.offset(0, i1),   // storage offsets of the corners in each dim
+          oy = vec.offset(1, j), oy1 = vec.offset(1, j1),
+          oz = vec.offset(2, k), oz1 = vec.offset(2, k1);
+    int   o[8] = { ox  + oy  + oz , ox1 + oy  + oz , ox  + oy1 + oz , ox1 + oy1 + oz ,
+                   ox  + oy  + oz1, ox1 + oy  + oz1, ox  + oy1 + oz1, ox1 + oy1 + oz1 };
+    int v;                                   // dimension
+
+    bool hit = false;                        // corners are in the cache
+    if (cache)
+    {
+        hit = cache->cell[0][slot] == i && cache->cell[1][slot] == j && cache->cell[2][slot] == k;
+        if (hit)
+            cache->hits++;
+        else
+        {
+            cache->misses++;
+            cache->cell[0][slot] = i;
+            cache->cell[1][slot] = j;
+            cache->cell[2][slot] = k;
+        }
+    }
+
+    for (v = 0; v < 3; v++)
+    {
+        if (hit)
+            for (int s = 0; s < 8; s++)
+                p[s] = cache->corner[v][s][slot];
+        else
+        {
+            vec.corners(v, o, p);
+            if (cache)
+                for (int s = 0; s < 8; s++)
+                    cache->corner[v][s][slot] = p[s];
+        }
+
+        vars[v] =
+            p[0] * (x1 - x) * (y1 - y) * (z1 - z) +
+            p[1] * (x - x0) * (y1 - y) * (z1 - z) +
+            p[2] * (x1 - x) * (y - y0) * (z1 - z) +
+            p[3] * (x - x0) * (y - y0) * (z1 - z) +
+            p[4] * (x1 - x) * (y1 - y) * (z - z0) +
+            p[5] * (x - x0) * (y1 - y) * (z - z0) +
+            p[6] * (x1 - x) * (y - y0) * (z - z0) +
+            p[7] * (x - x0) * (y - y0) * (z - z0);
+    }
+
+    return true;
+}
+
+// packet (batched) versions of lerp3D for 3-component vector fields
+//
+// points and results are in structure-of-arrays form: point l of the packet is
+// (pt[0][l], pt[1][l], pt[2][l]) and its interpolated vector is (vars[0][l], vars[1][l], vars[2][l])
+// valid is the lane mask: on input, only the points with valid[l] set are interpolated; on output,
+// valid[l] is 1 if the point was inside the block and interpolated, 0 otherwise, in which case
+// vars[.][l] is left untouched, same as lerp3D returning false
+//
+// the SIMD kernels perform exactly the same float operations in the same order as lerp3D
+// and deliberately do not fuse multiply-adds, so the results are bit-for-bit identical to
+// calling lerp3D on each point, as long as lerp3D itself is not contracted into FMAs
+// (the default x86-64 target has no FMA; with -march=native add -ffp-contract=off)
+// if lerp3D is built with FMA contraction, the two differ by at most 4 ulp of the largest
+// corner value of the cell (measured < 1 ulp)
+//
+// cache is an optional CellCache; point l of the packet uses slot l % CELL_CACHE_LANES
+// (o + l for the kernels that take the offset o of their points in the packet)
+//
+// if check is false, the inside test is skipped: the points with valid[l] set must be known to
+// be inside the block
+
+// scalar fallback, one lerp3D per point
+inline int lerp3D_packet_scalar(int                 n,          // number of points
+                                const float* const* pt,         // target points, SoA
+                                const int*          st,         // min corner of block
+                                const int*          sz,         // number of grid spaces in block
+                                const VecField&     vec,        // input vector field
+                                float* const*       vars,       // output interpolated vectors, SoA
+                                char*               valid,      // lane mask, in: points to interpolate, out: interpolated
+                                CellCache*          cache = NULL,
+                                int                 o     = 0,  // offset of the points in the packet (cache slot)
+                                bool                check = true)
+{
+    int nvalid = 0;
+    for (int l = 0; l < n; l++)
+    {
+        if (!valid[l])
+            continue;
+        float p[3] = { pt[0][l], pt[1][l], pt[2][l] };
+        float v[3];
+        valid[l] = lerp3D(p, st, sz, vec, v, cache, (o + l) % CELL_CACHE_LANES, check);
+        if (valid[l])
+        {
+            vars[0][l] = v[0];
+            vars[1][l] = v[1];
+            vars[2][l] = v[2];
+            nvalid++;
+        }
+    }
+    return nvalid;
+}
+
+#ifdef LERP_X86_SIMD
+
+// storage offsets of grid indices x in dim d, see VecField::offset
+__attribute__((target("avx2,f16c")))
+inline __m256i lerp3D_offset_avx2(const VecField& vec, int d, __m256i x)
+{
+    __m256i hi = _mm256_srlv_epi32(x, _mm256_set1_epi32(vec.shift));
+    __m256i lo = _mm256_and_si256(x, _mm256_set1_epi32((1 << vec.shift) - 1));
+    return _mm256_add_epi32(_mm256_mullo_epi32(hi, _mm256_set1_epi32(vec.bstride[d])),
+                            _mm256_mullo_epi32(lo, _mm256_set1_epi32(vec.lstride[d])));
+}
+
+// component v at storage offsets c of the lanes in mask, widened to float, 0 in the other lanes
+// 16-bit values are gathered 32 bits at a time from their byte offset and the upper half dropped
+__attribute__((target("avx2,f16c")))
+inline __m256 lerp3D_gather_avx2(const VecField& vec, int v, __m256i mask, __m256i c)
+{
+    if (vec.precision == FP32_PRECISION)
+        return _mm256_mask_i32gather_ps(_mm256_setzero_ps(), vec.ptrs[v], c, _mm256_castsi256_ps(mask), 4);
+
+    __m256i g = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)vec.hptrs[v], c, mask, 2);
+    switch (vec.precision)
+    {
+    case FP16_PRECISION:
+    {
+        __m256i h = _mm256_and_si256(g, _mm256_set1_epi32(0xffff));
+        h = _mm256_permute4x64_epi64(_mm256_packus_epi32(h, h), 0x08);
+        return _mm256_cvtph_ps(_mm256_castsi256_si128(h));
+    }
+    case BF16_PRECISION:
+        return _mm256_castsi256_ps(_mm256_slli_epi32(g, 16));
+    default:                                // INT16_PRECISION
+    {
+        __m256 q = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(g, 16), 16));
+        return _mm256_add_ps(_mm256_set1_ps(vec.bias[v]), _mm256_mul_ps(_mm256_set1_ps(vec.scale[v]), q));
+    }
+    }
+}
+
+// 8 points at offset o, AVX2 gathers
+__attribute__((target("avx2,f16c")))
+inline int lerp3D_packet_avx2(int                   o,
+                              const float* const*   pt,
+                              const int*            st,
+                              const int*            sz,
+                              const VecField&       vec,
+                              float* const*         vars,
+                              char*                 valid,
+                              CellCache*            cache,
+                              bool                  check)
+{
+    __m256  x   = _mm256_loadu_ps(pt[0] + o);
+    __m256  y   = _mm256_loadu_ps(pt[1] + o);
+    __m256  z   = _mm256_loadu_ps(pt[2] + o);
+
+    // lanes given by valid, and inside test, same bounds as inside()
+    __m256i vl  = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(valid + o)));
+    __m256  in  = _mm256_castsi256_ps(_mm256_cmpgt_epi32(vl, _mm256_setzero_si256()));
+    if (check)
+        in  = _mm256_and_ps(in,
+              _mm256_and_ps(
+                  _mm256_and_ps(
+                    _mm256_and_ps(_mm256_cmp_ps(x, _mm256_set1_ps((float)(st[0])), _CMP_GE_OQ),
+                                  _mm256_cmp_ps(x, _mm256_set1_ps((float)(st[0] + sz[0] - 1)), _CMP_LT_OQ)),
+                    _mm256_and_ps(_mm256_cmp_ps(y, _mm256_set1_ps((float)(st[1])), _CMP_GE_OQ),
+                                  _mm256_cmp_ps(y, _mm256_set1_ps((float)(st[1] + sz[1] - 1)), _CMP_LT_OQ))),
+                    _mm256_and_ps(_mm256_cmp_ps(z, _mm256_set1_ps((float)(st[2])), _CMP_GE_OQ),
+                                  _mm256_cmp_ps(z, _mm256_set1_ps((float)(st[2] + sz[2] - 1)), _CMP_LT_OQ))));
+    int     m   = _mm256_movemask_ps(in);
+    for (int l = 0; l < 8; l++)
+        valid[o + l] = (m >> l) & 1;
+    if (!m)
+        return 0;
+
+    // physical coords relative to min. of block, outside lanes are clamped to 0 so that
+    // the gathers stay in bounds
+    x = _mm256_and_ps(_mm256_sub_ps(x, _mm256_set1_ps((float)(st[0]))), in);
+    y = _mm256_and_ps(_mm256_sub_ps(y, _mm256_set1_ps((float)(st[1]))), in);
+    z = _mm256_and_ps(_mm256_sub_ps(z, _mm256_set1_ps((float)(st[2]))), in);
+
+    __m256i i   = _mm256_cvttps_epi32(_mm256_floor_ps(x));
+    __m256i j   = _mm256_cvttps_epi32(_mm256_floor_ps(y));
+    __m256i k   = _mm256_cvttps_epi32(_mm256_floor_ps(z));
+    __m256i one = _mm256_set1_epi32(1);
+    __m256  x0  = _mm256_cvtepi32_ps(i), x1 = _mm256_cvtepi32_ps(_mm256_add_epi32(i, one));
+    __m256  y0  = _mm256_cvtepi32_ps(j), y1 = _mm256_cvtepi32_ps(_mm256_add_epi32(j, one));
+    __m256  z0  = _mm256_cvtepi32_ps(k), z1 = _mm256_cvtepi32_ps(_mm256_add_epi32(k, one));
+
+    // storage offsets of the min and max corners in each dim, summed into the 8 corners
+    __m256i ox0 = lerp3D_offset_avx2(vec, 0, i), ox1 = lerp3D_offset_avx2(vec, 0, _mm256_add_epi32(i, one));
+    __m256i oy0 = lerp3D_offset_avx2(vec, 1, j), oy1 = lerp3D_offset_avx2(vec, 1, _mm256_add_epi32(j, one));
+    __m256i oz0 = lerp3D_offset_avx2(vec, 2, k), oz1 = lerp3D_offset_avx2(vec, 2, _mm256_add_epi32(k, one));
+    __m256i c[8];
+    c[0] = _mm256_add_epi32(_mm256_add_epi32(ox0, oy0), oz0);
+    c[1] = _mm256_add_epi32(_mm256_add_epi32(ox1, oy0), oz0);
+    c[2] = _mm256_add_epi32(_mm256_add_epi32(ox0, oy1), oz0);
+    c[3] = _mm256_add_epi32(_mm256_add_epi32(ox1, oy1), oz0);
+    c[4] = _mm256_add_epi32(_mm256_add_epi32(ox0, oy0), oz1);
+    c[5] = _mm256_add_epi32(_mm256_add_epi32(ox1, oy0), oz1);
+    c[6] = _mm256_add_epi32(_mm256_add_epi32(ox0, oy1), oz1);
+    c[7] = _mm256_add_epi32(_mm256_add_epi32(ox1, oy1), oz1);
+
+    __m256  wx0 = _mm256_sub_ps(x1, x), wx1 = _mm256_sub_ps(x, x0);
+    __m256  wy0 = _mm256_sub_ps(y1, y), wy1 = _mm256_sub_ps(y, y0);
+    __m256  wz0 = _mm256_sub_ps(z1, z), wz1 = _mm256_sub_ps(z, z0);
+    __m256  wx[8] = { wx0, wx1, wx0, wx1, wx0, wx1, wx0, wx1 };
+    __m256  wy[8] = { wy0, wy0, wy1, wy1, wy0, wy0, wy1, wy1 };
+    __m256  wz[8] = { wz0, wz0, wz0, wz0, wz1, wz1, wz1, wz1 };
+
+    // lanes whose corners are loaded: all inside lanes, or with a cache, those that moved to another cell
+    __m256i store_mask = _mm256_castps_si256(in);
+    __m256i load       = store_mask;
+    int     co         = o % CELL_CACHE_LANES;          // cache slot of the first lane
+    if (cache)
+    {
+        __m256i ci   = _mm256_loadu_si256((const __m256i*)(cache->cell[0] + co));
+        __m256i cj   = _mm256_loadu_si256((const __m256i*)(cache->cell[1] + co));
+        __m256i ck   = _mm256_loadu_si256((const __m256i*)(cache->cell[2] + co));
+        __m256i same = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi32(i, ci), _mm256_cmpeq_epi32(j, cj)),
+                                        _mm256_cmpeq_epi32(k, ck));
+        load         = _mm256_andnot_si256(same, load);
+        int nload    = __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(load)));
+        cache->misses += nload;
+        cache->hits   += __builtin_popcount(m) - nload;
+        _mm256_maskstore_epi32(cache->cell[0] + co, load, i);
+        _mm256_maskstore_epi32(cache->cell[1] + co, load, j);
+        _mm256_maskstore_epi32(cache->cell[2] + co, load, k);
+    }
+    bool    any_load   = _mm256_movemask_ps(_mm256_castsi256_ps(load)) != 0;
+
+    for (int v = 0; v < 3; v++)
+    {
+        // same association as lerp3D: (((p * wx) * wy) * wz), summed left to right
+        __m256 sum = _mm256_setzero_ps();
+        for (int s = 0; s < 8; s++)
+        {
+            __m256 p;
+            if (cache)
+            {
+                float* cp = cache->corner[v][s] + co;
+                p = _mm256_loadu_ps(cp);
+                if (any_load)
+                {
+                    p = _mm256_blendv_ps(p, lerp3D_gather_avx2(vec, v, load, c[s]), _mm256_castsi256_ps(load));
+                    _mm256_storeu_ps(cp, p);
+                }
+            }
+            else
+                p = lerp3D_gather_avx2(vec, v, load, c[s]);
+            __m256 t = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(p, wx[s]), wy[s]), wz[s]);
+            sum      = s ? _mm256_add_ps(sum, t) : t;
+        }
+        _mm256_maskstore_ps(vars[v] + o, store_mask, sum);
+    }
+
+    return __builtin_popcount(m);
+}
+
+// storage offsets of grid indices x in dim d, see VecField::offset
+__attribute__((target("avx512f")))
+inline __m512i lerp3D_offset_avx512(const VecField& vec, int d, __m512i x)
+{
+    __m512i hi = _mm512_srlv_epi32(x, _mm512_set1_epi32(vec.shift));
+    __m512i lo = _mm512_and_si512(x, _mm512_set1_epi32((1 << vec.shift) - 1));
+    return _mm512_add_epi32(_mm512_mullo_epi32(hi, _mm512_set1_epi32(vec.bstride[d])),
+                            _mm512_mullo_epi32(lo, _mm512_set1_epi32(vec.lstride[d])));
+}
+
+// component v at storage offsets c of the lanes in mask in, widened to float, 0 in the other lanes
+__attribute__((target("avx512f")))
+inline __m512 lerp3D_gather_avx512(const VecField& vec, int v, __mmask16 in, __m512i c)
+{
+    if (vec.precision == FP32_PRECISION)
+        return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), in, c, vec.ptrs[v], 4);
+
+    __m512i g = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), in, c, vec.hptrs[v], 2);
+    switch (vec.precision)
+    {
+    case FP16_PRECISION:
+        return _mm512_cvtph_ps(_mm512_cvtepi32_epi16(g));
+    case BF16_PRECISION:
+        return _mm512_castsi512_ps(_mm512_slli_epi32(g, 16));
+    default:                                // INT16_PRECISION
+    {
+        __m512 q = _mm512_cvtepi32_ps(_mm512_srai_epi32(_mm512_slli_epi32(g, 16), 16));
+        return _mm512_maskz_add_ps(in, _mm512_set1_ps(vec.bias[v]), _mm512_mul_ps(_mm512_set1_ps(vec.scale[v]), q));
+    }
+    }
+}
+
+// 16 points at offset o, AVX-512 gathers
+__attribute__((target("avx512f")))
+inline int lerp3D_packet_avx512(int                 o,
+                                const float* const* pt,
+                                const int*          st,
+                                const int*          sz,
+                                const VecField&     vec,
+                                float* const*       vars,
+                                char*               valid,
+                                CellCache*          cache,
+                                bool                check)
+{
+    __m512  x   = _mm512_loadu_ps(pt[0] + o);
+    __m512  y   = _mm512_loadu_ps(pt[1] + o);
+    __m512  z   = _mm512_loadu_ps(pt[2] + o);
+
+    // lanes given by valid, and inside test, same bounds as inside()
+    __m512i   vl = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(valid + o)));
+    __mmask16 in = _mm512_test_epi32_mask(vl, vl);
+    if (check)
+        in &=
+        _mm512_cmp_ps_mask(x, _mm512_set1_ps((float)(st[0])), _CMP_GE_OQ) &
+        _mm512_cmp_ps_mask(x, _mm512_set1_ps((float)(st[0] + sz[0] - 1)), _CMP_LT_OQ) &
+        _mm512_cmp_ps_mask(y, _mm512_set1_ps((float)(st[1])), _CMP_GE_OQ) &
+        _mm512_cmp_ps_mask(y, _mm512_set1_ps((float)(st[1] + sz[1] - 1)), _CMP_LT_OQ) &
+        _mm512_cmp_ps_mask(z, _mm512_set1_ps((float)(st[2])), _CMP_GE_OQ) &
+        _mm512_cmp_ps_mask(z, _mm512_set1_ps((float)(st[2] + sz[2] - 1)), _CMP_LT_OQ);
+    for (int l = 0; l < 16; l++)
+        valid[o + l] = (in >> l) & 1;
+    if (!in)
+        return 0;
+
+    // physical coords relative to min. of block, outside lanes are zeroed and masked off the gathers
+    x = _mm512_maskz_sub_ps(in, x, _mm512_set1_ps((float)(st[0])));
+    y = _mm512_maskz_sub_ps(in, y, _mm512_set1_ps((float)(st[1])));
+    z = _mm512_maskz_sub_ps(in, z, _mm512_set1_ps((float)(st[2])));
+
+    __m512i i   = _mm512_cvttps_epi32(_mm512_roundscale_ps(x, _MM_FROUND_TO_NEG_INF));
+    __m512i j   = _mm512_cvttps_epi32(_mm512_roundscale_ps(y, _MM_FROUND_TO_NEG_INF));
+    __m512i k   = _mm512_cvttps_epi32(_mm512_roundscale_ps(z, _MM_FROUND_TO_NEG_INF));
+    __m512i one = _mm512_set1_epi32(1);
+    __m512  x0  = _mm512_cvtepi32_ps(i), x1 = _mm512_cvtepi32_ps(_mm512_add_epi32(i, one));
+    __m512  y0  = _mm512_cvtepi32_ps(j), y1 = _mm512_cvtepi32_ps(_mm512_add_epi32(j, one));
+    __m512  z0  = _mm512_cvtepi32_ps(k), z1 = _mm512_cvtepi32_ps(_mm512_add_epi32(k, one));
+
+    // storage offsets of the min and max corners in each dim, summed into the 8 corners
+    __m512i ox0 = lerp3D_offset_avx512(vec, 0, i), ox1 = lerp3D_offset_avx512(vec, 0, _mm512_add_epi32(i, one));
+    __m512i oy0 = lerp3D_offset_avx512(vec, 1, j), oy1 = lerp3D_offset_avx512(vec, 1, _mm512_add_epi32(j, one));
+    __m512i oz0 = lerp3D_offset_avx512(vec, 2, k), oz1 = lerp3D_offset_avx512(vec, 2, _mm512_add_epi32(k, one));
+    __m512i c[8];
+    c[0] = _mm512_add_epi32(_mm512_add_epi32(ox0, oy0), oz0);
+    c[1] = _mm512_add_epi32(_mm512_add_epi32(ox1, oy0), oz0);
+    c[2] = _mm512_add_epi32(_mm512_add_epi32(ox0, oy1), oz0);
+    c[3] = _mm512_add_epi32(_mm512_add_epi32(ox1, oy1), oz0);
+    c[4] = _mm512_add_epi32(_mm512_add_epi32(ox0, oy0), oz1);
+    c[5] = _mm512_add_epi32(_mm512_add_epi32(ox1, oy0), oz1);
+    c[6] = _mm512_add_epi32(_mm512_add_epi32(ox0, oy1), oz1);
+    c[7] = _mm512_add_epi32(_mm512_add_epi32(ox1, oy1), oz1);
+
+    __m512  wx0 = _mm512_sub_ps(x1, x), wx1 = _mm512_sub_ps(x, x0);
+    __m512  wy0 = _mm512_sub_ps(y1, y), wy1 = _mm512_sub_ps(y, y0);
+    __m512  wz0 = _mm512_sub_ps(z1, z), wz1 = _mm512_sub_ps(z, z0);
+    __m512  wx[8] = { wx0, wx1, wx0, wx1, wx0, wx1, wx0, wx1 };
+    __m512  wy[8] = { wy0, wy0, wy1, wy1, wy0, wy0, wy1, wy1 };
+    __m512  wz[8] = { wz0, wz0, wz0, wz0, wz1, wz1, wz1, wz1 };
+
+    // lanes whose corners are loaded: all inside lanes, or with a cache, those that moved to another cell
+    __mmask16 load = in;
+    int       co   = o % CELL_CACHE_LANES;              // cache slot of the first lane
+    if (cache)
+    {
+        __m512i ci = _mm512_loadu_si512(cache->cell[0] + co);
+        __m512i cj = _mm512_loadu_si512(cache->cell[1] + co);
+        __m512i ck = _mm512_loadu_si512(cache->cell[2] + co);
+        load &= ~(_mm512_cmpeq_epi32_mask(i, ci) & _mm512_cmpeq_epi32_mask(j, cj) & _mm512_cmpeq_epi32_mask(k, ck));
+        int nload = __builtin_popcount(load);
+        cache->misses += nload;
+        cache->hits   += __builtin_popcount(in) - nload;
+        _mm512_mask_storeu_epi32(cache->cell[0] + co, load, i);
+        _mm512_mask_storeu_epi32(cache->cell[1] + co, load, j);
+        _mm512_mask_storeu_epi32(cache->cell[2] + co, load, k);
+    }
+
+    for (int v = 0; v < 3; v++)
+    {
+        // same association as lerp3D: (((p * wx) * wy) * wz), summed left to right
+        __m512 sum = _mm512_setzero_ps();
+        for (int s = 0; s < 8; s++)
+        {
+            __m512 p;
+            if (cache)
+            {
+                float* cp = cache->corner[v][s] + co;
+                p = _mm512_loadu_ps(cp);
+                if (load)
+                {
+                    p = _mm512_mask_blend_ps(load, p, lerp3D_gather_avx512(vec, v, load, c[s]));
+                    _mm512_storeu_ps(cp, p);
+                }
+            }
+            else
+                p = lerp3D_gather_avx512(vec, v, load, c[s]);
+            __m512 t = _mm512_mul_ps(_mm512_mul_ps(_mm512_mul_ps(p, wx[s]), wy[s]), wz[s]);
+            sum      = s ? _mm512_add_ps(sum, t) : t;
+        }
+        _mm512_mask_storeu_ps(vars[v] + o, in, sum);
+    }
+
+    return __builtin_popcount(in);
+}
+
+// widest packet kernel supported by the cpu at run time: 16, 8, or 1 (scalar)
+inline int lerp3D_packet_width()
+{
+    static const int width =
+        __builtin_cpu_supports("avx512f") ? 16 :
+        __builtin_cpu_supports("avx2") &&
+        __builtin_cpu_supports("f16c")    ? 8  : 1;
+    return width;
+}
+
+#else
+
+inline int lerp3D_packet_width()
+{
+    return 1;
+}
+
+#endif
+
+// packet interpolation of n points, dispatching at run time to the widest available kernel
+// returns the number of points that were inside the block and interpolated
+inline int lerp3D_packet(int                    n,          // number of points
+                         const float* const*    pt,         // target points, SoA
+                         const int*             st,         // min corner of block
+                         const int*             sz,         // number of grid spaces in block
+                         const VecField&        vec,        // input vector field
+                         float* const*          vars,       // output interpolated vectors, SoA
+                         char*                  valid,      // lane mask, in: points to interpolate, out: interpolated
+                         CellCache*             cache = NULL,
+                         bool                   check = true)
+{
+    int nvalid = 0;
+    int o      = 0;                          // offset of current group of points in the packet
+
+#ifdef LERP_X86_SIMD
+    int width  = lerp3D_packet_width();
+    if (width == 16)
+        for (; o + 16 <= n; o += 16)
+            nvalid += lerp3D_packet_avx512(o, pt, st, sz, vec, vars, valid, cache, check);
+    if (width >= 8)
+        for (; o + 8 <= n; o += 8)
+            nvalid += lerp3D_packet_avx2(o, pt, st, sz, vec, vars, valid, cache, check);
+#endif
+
+    // remainder
+    if (o < n)
+    {
+        const float*    pt_o[3]   = { pt[0] + o, pt[1] + o, pt[2] + o };
+        float*          vars_o[3] = { vars[0] + o, vars[1] + o, vars[2] + o };
+        nvalid += lerp3D_packet_scalar(n - o, pt_o, st, sz, vec, vars_o, valid + o, cache, o, check);
+    }
+
+    return nvalid;
+}
+
 
 inline bool lerp4D(const float*     pt,
                    const int*       st,
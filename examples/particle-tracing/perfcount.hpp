@@ -0,0 +1,92 @@
+//---------------------------------------------------------------------------
+//
+// hardware cache miss counters of the calling thread, for measuring the memory behavior of
+// particle tracing (e.g., the effect of sorting the particles by cell)
+//
+// uses the generic perf events of Linux, L1D and last level cache (LLC) load misses; there is no
+// generic event for L2 misses; elsewhere, or where perf events are not permitted (see
+// /proc/sys/kernel/perf_event_paranoid), the counters are not available and read as 0
+//
+//--------------------------------------------------------------------------
+
+#ifndef _PERFCOUNT_HPP
+#define _PERFCOUNT_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum CacheMissEvent
+{
+    L1D_MISSES      = 0,                    // L1 data cache load misses
+    LLC_MISSES      = 1,                    // last level cache load misses
+    NUM_MISS_EVENTS
+};
+
+class CacheMissCounters
+{
+public:
+    CacheMissCounters()
+    {
+        for (int e = 0; e < NUM_MISS_EVENTS; e++)
+            fd[e] = -1;
+#ifdef __linux__
+        const uint64_t cache[NUM_MISS_EVENTS] = { PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_LL };
+        for (int e = 0; e < NUM_MISS_EVENTS; e++)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size           = sizeof(attr);
+            attr.type           = PERF_TYPE_HW_CACHE;
+            attr.config         = cache[e] |
+                                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            attr.exclude_kernel = 1;
+            attr.exclude_hv     = 1;
+            fd[e] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);   // this thread, any cpu
+        }
+#endif
+    }
+
+    ~CacheMissCounters()
+    {
+#ifdef __linux__
+        for (int e = 0; e < NUM_MISS_EVENTS; e++)
+            if (fd[e] >= 0)
+                close(fd[e]);
+#endif
+    }
+
+    // running counts since the counters were opened
+    void read(uint64_t* counts) const
+    {
+        for (int e = 0; e < NUM_MISS_EVENTS; e++)
+        {
+            counts[e] = 0;
+#ifdef __linux__
+            if (fd[e] >= 0 && ::read(fd[e], &counts[e], sizeof(uint64_t)) != sizeof(uint64_t))
+                counts[e] = 0;
+#endif
+        }
+    }
+
+    // the counters of the calling thread, opened on first use
+    static const CacheMissCounters& thread()
+    {
+        static thread_local CacheMissCounters counters;
+        return counters;
+    }
+
+private:
+    CacheMissCounters(const CacheMissCounters&);
+    CacheMissCounters& operator=(const CacheMissCounters&);
+
+    int fd[NUM_MISS_EVENTS];
+};
+
+#endif
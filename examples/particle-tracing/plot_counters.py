@@ -3,8 +3,8 @@ Python script for plotting number of times iexchange callback is called and numb
 rounds needed for all particles to be fully traced with synchronous DIY. This script 
 required output files generated by the following commands:
 
-./NEK_TEST1 &> output_nek_iex.txt   // executable ./ptrace built with IEXCHANGE=1 in ptrace.cpp
-./NEK_TEST1 &> output_nek_isyn.txt  // executable ./ptrace built with IEXCHANGE=0 in ptrace.cpp
+./NEK_TEST1 &> output_nek_iex.txt   // with --exchange 1 in the options of NEK_TEST1
+./NEK_TEST1 &> output_nek_isyn.txt  // with --exchange 0 in the options of NEK_TEST1
 
 '''
 
@@ -12,7 +12,7 @@ import matplotlib
 matplotlib.use('TkAgg')
 import matplotlib.pyplot as plt
 
-# paths to output files generated using ./NEK_TEST1 with IEXCHANGE=1 and IEXCHANGE=0
+# paths to output files generated using ./NEK_TEST1 with --exchange 1 and --exchange 0
 opfile_iex = "./output_nek_iex.txt"
 opfile_syn = "./output_nek_syn.txt"
 
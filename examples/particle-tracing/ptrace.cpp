@@ -43,11 +43,17 @@
 #endif
 
 #include <cassert>
+#include <cfloat>
+#include <climits>
 #include <cstring>
+#include <atomic>
 
 #include "../opts.h"
 #include "ptrace.hpp"
 #include "block.hpp"
+#include "integrator.hpp"
+#include "workpool.hpp"
+#include "perfcount.hpp"
 
 #include "advect.h"
 #include "lerp.hpp"
@@ -86,6 +92,10 @@ void InitSeeds(Block*                       b,
                 p.pid = b->init;
                 p.gid = gid;
                 p[0] = i;  p[1] = j;  p[2] = k;
+                p.seed = p.pt;
+                p.anchor = p.pt;
+                for (int d = 0; d < 3; d++)
+                    p.cell[d] = floor(p[d]);
                 b->particles.push_back(p);
                 b->init++;
             }
@@ -93,18 +103,305 @@ void InitSeeds(Block*                       b,
     }
 }
 
+// what a tracing thread other than thread 0 produces, merged into the block by merge_output()
+// after the threads are done, since the block and the proxy are not thread-safe
+struct TraceOutput
+{
+    SegmentStore                        segments;
+    vector<ParticleSummary>             summaries;
+    vector< pair<diy::BlockID, EndPt> > outgoing;   // end points to enqueue or send
+    int                                 done;
+
+    TraceOutput() : done(0)             {}
+};
+
+// the fields of end points that the settings need, see encode_endpts()
+WireFormat wire_format(const IntegratorParams& integ)
+{
+    WireFormat wf;
+    wf.flags   = (integ.raw_endpts                    ? WIRE_RAW       :
+                  integ.wire_quantum > 0.0            ? WIRE_QUANTIZED : 0) |
+                 (integ.type == RK45_INTEGRATOR       ? WIRE_H         : 0) |
+                 (integ.endpoints                     ? WIRE_SUMMARY   : 0) |
+                 (integ.window > 0                    ? WIRE_ANCHOR    : 0) |
+                 (integ.cell_steps > 0                ? WIRE_CELL      : 0);
+    wf.quantum = integ.wire_quantum;
+    return wf;
+}
+
+// the reference of the end points sent to neighbor gid, the min. corner of its core
+void wire_ref(const diy::Master::ProxyWithLink& cp, int gid, int* ref)
+{
+    diy::RegularLink<Bounds> *l = static_cast<diy::RegularLink<Bounds>*>(cp.link());
+    const Bounds& core = l->core(l->find(gid));
+    for (int i = 0; i < 3; i++)
+        ref[i] = core.min[i];
+}
+
+// sends n end points to block bid as one message: its size in bytes, followed by the compact form
+// of encode_endpts(), with the core of the receiving block as the reference
+void send_endpts(Block*                             b,
+                 const diy::Master::ProxyWithLink&  cp,
+                 const IntegratorParams&            integ,
+                 const diy::BlockID&                bid,
+                 const EndPt*                       pts,
+                 size_t                             n)
+{
+    int ref[3];
+    wire_ref(cp, bid.gid, ref);
+
+    static thread_local vector<uint8_t> bytes;  // reused by the messages of this thread
+    bytes.clear();
+    encode_endpts(pts, n, wire_format(integ), ref, cp.gid(), bytes);
+    size_t nbytes = bytes.size();
+    cp.enqueue(bid, nbytes);
+    cp.enqueue(bid, bytes.data(), nbytes);
+
+    b->counts[COUNT_MESSAGES]++;
+    b->counts[COUNT_MESSAGE_BYTES] += sizeof(size_t) + nbytes;
+    b->counts[COUNT_ENDPTS_SENT]   += n;
+}
+
+// receives one message of send_endpts() from block gid src into the particles of the block
+void recv_endpts(Block*                             b,
+                 const diy::Master::ProxyWithLink&  cp,
+                 int                                src)
+{
+    diy::RegularLink<Bounds> *l = static_cast<diy::RegularLink<Bounds>*>(cp.link());
+    const int ref[3] = { l->core().min[0], l->core().min[1], l->core().min[2] };
+
+    size_t nbytes;
+    cp.dequeue(src, nbytes);
+    const uint8_t* p = (const uint8_t*)cp.incoming(src).advance(nbytes);    // decoded in place
+    b->particles.append_encoded(p, ref, src);
+}
+
+// finish the segment of a particle that stopped advancing in this block
+// either the particle is done, or its end point is sent to the neighbor block containing it
+// in endpoint mode, only a summary of a finished particle is kept, and no segments
+// out is NULL for writing to the block and the proxy directly, otherwise the results go there
+// returns the ExitReason of the particle, EXIT_NONE if it continues in another block
+int end_segment(Block*                             b,
+                const diy::Master::ProxyWithLink&  cp,
+                const Decomposer&                  decomposer,
+                Segment&                           s,
+                size_t                             i,          // index of the particle in b->particles
+                int                                reason,     // ExitReason known to the caller
+                const IntegratorParams&            integ,      // tracing settings
+                const utl::NeighborTable<Bounds>&  nbrs,       // neighbor lookup of the block
+                TraceOutput*                       out,
+                map<diy::BlockID, vector<EndPt> >& outgoing_endpts)
+{
+    diy::RegularLink<Bounds> *l = static_cast<diy::RegularLink<Bounds>*>(cp.link());
+    const ParticlePool& P = b->particles;
+    const Pt& end_p = s.pts.back();             // last point of the segment
+
+    if (reason == EXIT_NONE && !inside(end_p, decomposer.domain))
+        reason = EXIT_DOMAIN;
+    s.reason = reason;
+
+    if (reason != EXIT_NONE)                    // this segment is done
+    {
+        (out ? out->done : b->done)++;
+        if (integ.endpoints)
+        {
+            ParticleSummary ps;
+            ps.pid    = s.pid;
+            ps.gid    = s.gid;
+            ps.seed   = P.seed[i];
+            ps.end    = end_p;
+            ps.len    = P.len[i];
+            ps.nsteps = P.nsteps[i];
+            ps.reason = reason;
+            (out ? out->summaries : b->summaries).push_back(ps);
+        }
+    }
+    else                                        // find destination of segment endpoint
+    {
+        int dest = nbrs.find(end_p.coords);     // in case of multiple dests, the first one
+
+        EndPt out_pt(s);
+        out_pt.nsteps = P.nsteps[i];
+        out_pt.h      = P.h[i];                 // adaptive step size survives the hand-off
+        out_pt.seed   = P.seed[i];
+        out_pt.len    = P.len[i];
+        out_pt.anchor = P.anchor[i];
+        for (int d = 0; d < 3; d++)
+            out_pt.cell[d] = P.cell[d][i];
+        out_pt.cell_steps = P.cell_steps[i];
+        if (dest >= 0)
+        {
+            diy::BlockID bid = l->target(dest);
+
+            // debug
+//             fmt::print(stderr, "gid {} enq to gid {}\n", cp.gid(), bid.gid);
+
+            if (out)
+                out->outgoing.push_back(make_pair(bid, out_pt));
+            else if (integ.iexchange && integ.fine) // enqueuing single endpoint allows fine-grain iexchange
+                send_endpts(b, cp, integ, bid, &out_pt, 1);
+            else
+                outgoing_endpts[bid].push_back(out_pt); // vector of endpoints, coalesced by the caller
+        }
+    }
+
+    if (!integ.endpoints)
+        (out ? out->segments : b->segments).push_back(s);   // copied, so that the lane keeps its buffer
+    return reason;
+}
+
+void merge_output(Block*                             b,
+                  const diy::Master::ProxyWithLink&  cp,
+                  TraceOutput&                       out,
+                  const IntegratorParams&            integ,
+                  map<diy::BlockID, vector<EndPt> >& outgoing_endpts)
+{
+    b->done += out.done;
+    b->segments.append(out.segments);
+    b->summaries.insert(b->summaries.end(), out.summaries.begin(), out.summaries.end());
+    for (size_t k = 0; k < out.outgoing.size(); k++)
+    {
+        if (integ.iexchange && integ.fine)
+            send_endpts(b, cp, integ, out.outgoing[k].first, &out.outgoing[k].second, 1);
+        else
+            outgoing_endpts[out.outgoing[k].first].push_back(out.outgoing[k].second);
+    }
+}
+
+// thins out the points of a finished segment in place, before it is stored, keeping its first and last point
+// with decimate > 1, only the points after every decimate-th step of the particle are kept, counted from
+// its seed so that the choice does not depend on the blocks the particle went through
+// with simplify > 0, the remaining points are then reduced to those that the polyline needs to pass
+// within simplify of the dropped ones (Douglas-Peucker)
+// keep and ranges are scratch space, reused across calls
+void thin_segment(Segment&                          s,
+                  int                               first_step, // step count of the first point of s
+                  int                               decimate,
+                  float                             simplify,
+                  vector<char>&                     keep,
+                  vector< pair<size_t, size_t> >&   ranges)
+{
+    vector<Pt>& pts = s.pts;
+    size_t      n   = pts.size();
+    if (n <= 2)
+        return;
+
+    if (decimate > 1)
+    {
+        size_t m = 1;
+        for (size_t k = 1; k < n - 1; k++)
+            if ((first_step + k) % decimate == 0)
+                pts[m++] = pts[k];
+        pts[m++] = pts[n - 1];
+        pts.resize(m);
+        n = m;
+    }
+
+    if (simplify <= 0.0 || n <= 2)
+        return;
+
+    keep.assign(n, 0);
+    keep[0] = keep[n - 1] = 1;
+    ranges.clear();
+    ranges.push_back(make_pair((size_t)0, n - 1));
+    while (!ranges.empty())
+    {
+        size_t a = ranges.back().first, c = ranges.back().second;
+        ranges.pop_back();
+
+        // the point between a and c farthest from the line segment a-c
+        const float* pa = &pts[a].coords[0];
+        float ac[3], ac2 = 0.0;
+        for (int d = 0; d < 3; d++)
+        {
+            ac[d] = pts[c].coords[d] - pa[d];
+            ac2  += ac[d] * ac[d];
+        }
+        float  max_d2 = 0.0;
+        size_t max_k  = a;
+        for (size_t k = a + 1; k < c; k++)
+        {
+            float ak[3], t = 0.0;
+            for (int d = 0; d < 3; d++)
+            {
+                ak[d] = pts[k].coords[d] - pa[d];
+                t    += ak[d] * ac[d];
+            }
+            t = ac2 > 0.0 ? t / ac2 : 0.0;
+            t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+            float d2 = 0.0;
+            for (int d = 0; d < 3; d++)
+                d2 += (ak[d] - t * ac[d]) * (ak[d] - t * ac[d]);
+            if (d2 > max_d2)
+            {
+                max_d2 = d2;
+                max_k  = k;
+            }
+        }
+        if (max_d2 > simplify * simplify)
+        {
+            keep[max_k] = 1;
+            if (max_k - a > 1)
+                ranges.push_back(make_pair(a, max_k));
+            if (c - max_k > 1)
+                ranges.push_back(make_pair(max_k, c));
+        }
+    }
+
+    size_t m = 0;
+    for (size_t k = 0; k < n; k++)
+        if (keep[k])
+            pts[m++] = pts[k];
+    pts.resize(m);
+}
+
 // common to both exchange and iexchange
-void trace_particles(Block*                             b,
+// particles are traced in lockstep, PACKET_SIZE at a time, in structure-of-arrays lanes;
+// a lane whose particle leaves the block or finishes is refilled with the next particle
+// Integrator is one of the policies in integrator.hpp
+// particles are traced through the bounds of the block, i.e., its core and the ghost layer around it,
+// and handed off to the neighbor whose core contains them only once they leave the bounds; the wider
+// the ghost layer (--ghost), the fewer hand-offs of particles that move back and forth across a face
+// with fast_path, each lane counts how many more steps its particle can take without being able
+// to leave the block, from the max. velocity of the block and Integrator::reach(); lanes with
+// steps left are advanced without bounds checks, the others with them, and the count is
+// recomputed from the current point once it runs out
+// with endpoints, a lane keeps only the first and the current point of its segment; otherwise,
+// finished segments are thinned out by thin_segment() before they are stored
+// besides max_steps, the termination criteria of integ end a particle that stagnates or circles:
+// - speed below integ.min_speed at the new point; the velocity is interpolated only when the step
+//   was short enough for that to be possible (not for stochastic integrators, which do not follow it)
+// - displacement less than integ.min_disp over each window of integ.window steps, counted from the
+//   seed; the start of the window is kept in the particle and travels with it between blocks
+// - integ.cell_steps consecutive steps in the same cell; the cell and the count are kept in the
+//   particle, so that they survive suspensions and hand-offs
+// with steps_left, at most *steps_left particle steps are taken, and *steps_left is decreased by the steps
+// taken; once it is used up, the particles in the lanes store their segments so far and are
+// suspended, and the particles not finished in this block are left in b->particles, in order,
+// to be traced by the next call; returns whether all particles were finished
+// with integ.workers, the particles are split into chunks of TRACE_CHUNK that the threads of the
+// pool take from ChunkQueues, each thread with its own lanes; thread 0 writes to the block and the
+// proxy directly, the other threads to a TraceOutput each, merged into the block afterwards
+const size_t TRACE_CHUNK = 4 * PACKET_SIZE;     // particles per chunk for the worker threads
+
+template<class Integrator>
+bool trace_particles(Block*                             b,
                      const diy::Master::ProxyWithLink&  cp,
                      const Decomposer&                  decomposer,
                      const int                          max_steps,
+                     const Integrator&                  integrator,
+                     const IntegratorParams&            integ,      // tracing settings
+                     const utl::NeighborTable<Bounds>&  nbrs,
+                     size_t*                            steps_left, // particle steps left, NULL = unlimited
                      map<diy::BlockID, vector<EndPt> >& outgoing_endpts)
 {
     diy::RegularLink<Bounds> *l = static_cast<diy::RegularLink<Bounds>*>(cp.link());
+    const float h           = integ.h;         // initial step size of adaptive integrators
+    const bool  fast_path   = integ.fast_path;
+    const bool  endpoints   = integ.endpoints;
+    const bool  thin        = !endpoints && (integ.decimate > 1 || integ.simplify > 0.0);
 
-    const float *vec[3] = {b->vel[0],           // shallow pointer copy
-                           b->vel[1],
-                           b->vel[2]};
+    const VecField vec  = b->field();           // shallow pointer copy
     const int   st[3]   = {l->bounds().min[0],
                            l->bounds().min[1],
                            l->bounds().min[2]};
@@ -112,55 +409,333 @@ void trace_particles(Block*                             b,
                            l->bounds().max[1] - l->bounds().min[1] + 1,
                            l->bounds().max[2] - l->bounds().min[2] + 1};
 
-    for (auto i = 0; i < b->particles.size(); i++)
+    // the bounds of Integrator::reach() are padded for the rounding of the interpolation and
+    // of the particle coordinates
+    const float vmax = 1.01 * b->max_vel;
+    float eps = 0.0;
+    for (int i = 0; i < 3; i++)
+        eps = max(eps, 8 * FLT_EPSILON * max(fabs((float)st[i]), fabs((float)(st[i] + sz[i]))));
+
+    ParticlePool&   P       = b->particles;
+    const size_t    nchunks = (P.size() + TRACE_CHUNK - 1) / TRACE_CHUNK;
+    const int       nthreads = integ.workers && nchunks > 1 ? integ.workers->size() : 1;
+    ChunkQueues     chunks(nchunks, nthreads);
+    vector<TraceOutput> outputs(nthreads);      // outputs[0] is unused, thread 0 writes to the block
+    vector<size_t>  counts(NUM_COUNTS * nthreads, 0);   // TraceCount counters of each thread
+    for (int t = 1; t < nthreads; t++)
+        outputs[t].segments.set_quantum(b->segments.quantum, b->segments.origin);
+    atomic<size_t>  used(0);                    // particle steps taken, shared by the threads (with steps_left)
+    vector<char>    finished;                   // particles finished in this block (with steps_left)
+    if (steps_left)
+        finished.resize(P.size(), 0);
+
+    auto trace = [&](int tid)
     {
-        Pt&     cur_p = b->particles[i].pt;     // current end point
-        Segment s(b->particles[i]);             // segment with one point p
-        Pt      next_p;                         // coordinates of next end point
-        bool    finished = false;
-
-        // trace this segment until it leaves the block
-        while (advect_rk1(st, sz, vec, cur_p.coords.data(), 0.5, next_p.coords.data()))
+        float           X[3][PACKET_SIZE];          // current end points of the lanes, SoA
+        float*          Xp[3]  = { X[0], X[1], X[2] };
+        float           H[PACKET_SIZE];             // step size of each lane (adaptive integrators)
+        uint32_t        ids[3][PACKET_SIZE];        // gid, pid, nsteps of each lane (stochastic integrators)
+        uint32_t*       idsp[3] = { ids[0], ids[1], ids[2] };
+        char            active[PACKET_SIZE];        // lane holds a particle that is still advancing
+        char            fast[PACKET_SIZE];          // active lanes stepped without / with bounds checks
+        char            slow[PACKET_SIZE];
+        int             safe[PACKET_SIZE];          // steps the lane's particle is known to stay inside
+        size_t          idx[PACKET_SIZE];           // index of the lane's particle in b->particles
+        float           H0[PACKET_SIZE];            // step size of each lane before the step (adaptive integrators)
+        vector<Segment> segs(PACKET_SIZE);          // segment being traced in each lane, reused
+        size_t          next    = 0;                // next particle to load into a free lane
+        size_t          end     = 0;                // end of the current chunk
+        int             nactive = 0;
+        CellCache       cache;                      // corners of the cell each lane last interpolated in
+        CellCache*      cachep  = integ.cell_cache ? &cache : NULL;
+        vector<char>    keep;                       // scratch space of thin_segment()
+        vector< pair<size_t, size_t> > ranges;
+        TraceOutput*    out     = tid ? &outputs[tid] : NULL;
+        size_t*         count   = &counts[NUM_COUNTS * tid];
+        uint64_t        misses0[NUM_MISS_EVENTS];
+        if (integ.miss_counters)
+            CacheMissCounters::thread().read(misses0);
+
+        // number of steps from the current point of lane j that cannot leave the block:
+        // the k-th step (k = 0, 1, ...) stays inside if k * R + E < d; at most one for adaptive
+        // integrators, whose step size may grow
+        auto budget = [&](int j) -> int
         {
-            b->particles[i].nsteps++;
-            s.pts.push_back(next_p);
-            cur_p = next_p;
-            if (b->particles[i].nsteps >= max_steps)
+            float R, E;
+            integrator.reach(vmax, Integrator::adaptive ? H[j] : h, R, E);
+            R += eps;
+            E += eps;
+            float d = FLT_MAX;                      // distance to the block boundary
+            for (int i = 0; i < 3; i++)
+                d = min(d, min(X[i][j] - st[i], st[i] + sz[i] - 1 - X[i][j]));
+            if (!(d > E))                           // also for NaN
+                return 0;
+            if (Integrator::adaptive)
+                return 1;
+            double q = (d - E) / R;
+            return q >= max_steps ? max_steps : (int)ceil(q);
+        };
+
+        // load the next particle into a free lane, taking the next chunk when the current one is
+        // exhausted; false if there are no particles left
+        auto load = [&](int j) -> bool
+        {
+            if (next == end)
             {
-                finished = true;
-                break;
+                size_t c;
+                if (!chunks.pop(tid, c))
+                    return false;
+                next = c * TRACE_CHUNK;
+                end  = min(next + TRACE_CHUNK, P.size());
             }
-        }
-        b->segments.push_back(s);
+            size_t i  = next++;
+            idx[j]    = i;
+            X[0][j]   = P.x[0][i];
+            X[1][j]   = P.x[1][i];
+            X[2][j]   = P.x[2][i];
+            segs[j].pid = P.pid[i];
+            segs[j].gid = P.gid[i];
+            segs[j].pts.clear();
+            Pt pt { { X[0][j], X[1][j], X[2][j] } };
+            segs[j].pts.push_back(pt);
+            if (Integrator::adaptive)
+                H[j]  = P.h[i] > 0.0 ? P.h[i] : h;
+            if (Integrator::stochastic)
+            {
+                ids[0][j] = P.gid[i];
+                ids[1][j] = P.pid[i];
+                ids[2][j] = P.nsteps[i];
+            }
+            active[j] = 1;
+            safe[j]   = 0;
+            nactive++;
+            return true;
+        };
+
+        // termination criteria after lane j advanced particle i to p by a step of length disp
+        auto stop = [&](int j, size_t i, const Pt& p, float disp) -> int
+        {
+            if (integ.min_speed > 0.0 && !Integrator::stochastic)
+            {
+                float hb = h;                       // bound on the step size that was taken
+                if (Integrator::adaptive)
+                    hb = min(max(H0[j], integ.h_min), integ.h_max);
+                float v[3];
+                if (disp < integ.min_speed * hb &&
+                    lerp3D(&p.coords[0], st, sz, vec, v) &&
+                    v[0] * v[0] + v[1] * v[1] + v[2] * v[2] < integ.min_speed * integ.min_speed)
+                    return EXIT_MIN_SPEED;
+            }
+            if (integ.window > 0 && P.nsteps[i] % integ.window == 0)
+            {
+                float d2 = 0.0;
+                for (int d = 0; d < 3; d++)
+                    d2 += (p.coords[d] - P.anchor[i].coords[d]) * (p.coords[d] - P.anchor[i].coords[d]);
+                if (d2 < integ.min_disp * integ.min_disp)
+                    return EXIT_MIN_DISP;
+                P.anchor[i] = p;
+            }
+            if (integ.cell_steps > 0)
+            {
+                bool same = true;
+                for (int d = 0; d < 3; d++)
+                {
+                    int c = floor(p.coords[d]);
+                    same  = same && c == P.cell[d][i];
+                    P.cell[d][i] = c;
+                }
+                P.cell_steps[i] = same ? P.cell_steps[i] + 1 : 0;
+                if (P.cell_steps[i] >= integ.cell_steps)
+                    return EXIT_CELL_STEPS;
+            }
+            return EXIT_NONE;
+        };
 
-        if (!inside(next_p, decomposer.domain))
-            finished = true;
+        // lanes that load() cannot fill keep a defined point, inside the block
+        for (int j = 0; j < PACKET_SIZE; j++)
+        {
+            for (int d = 0; d < 3; d++)
+                X[d][j] = st[d];
+            active[j] = 0;
+            idx[j]    = P.size();
+            load(j);
+        }
 
-        if (finished)                    // this segment is done
-            b->done++;
-        else                             // find destination of segment endpoint
+        // out of budget: keep the segment so far, and the particle in the pool
+        auto suspend = [&](int j)
         {
-            vector<int> dests;
-            vector<int>::iterator it = dests.begin();
-            insert_iterator<vector<int> > insert_it(dests, it);
+            size_t i = idx[j];
+            for (int d = 0; d < 3; d++)
+                P.x[d][i] = X[d][j];
+            if (segs[j].pts.size() > 1)
+            {
+                if (thin)
+                    thin_segment(segs[j], P.nsteps[i] - (segs[j].pts.size() - 1), integ.decimate, integ.simplify,
+                                 keep, ranges);
+                segs[j].reason = EXIT_NONE;
+                if (!endpoints)
+                    (out ? out->segments : b->segments).push_back(segs[j]);
+            }
+        };
 
-            utl::in(*l, next_p.coords, insert_it, decomposer.domain, 1);
+        // trace the segments until they leave the block
+        while (nactive)
+        {
+            if (steps_left && used.load(memory_order_relaxed) >= *steps_left)
+            {
+                for (int j = 0; j < PACKET_SIZE; j++)
+                    if (idx[j] != P.size())
+                        suspend(j);
+                break;
+            }
 
-            EndPt out_pt(s);
-            out_pt.nsteps = b->particles[i].nsteps;
-            if (dests.size())
+            // lanes that could not advance are cleared from active
+            int nfast = 0, nslow = 0;
+            for (int j = 0; j < PACKET_SIZE; j++)
             {
-                diy::BlockID bid = l->target(dests[0]); // in case of multiple dests, send to first dest only
+                if (fast_path && active[j] && safe[j] <= 0)
+                    safe[j] = budget(j);
+                fast[j] = active[j] && safe[j] > 0;
+                slow[j] = active[j] && !fast[j];
+                nfast  += fast[j];
+                nslow  += slow[j];
+            }
+            if (Integrator::adaptive && integ.min_speed > 0.0)
+                memcpy(H0, H, sizeof(H));
+            if (nfast)
+                integrator.step(st, sz, vec, PACKET_SIZE, Xp, H, idsp, fast, cachep, false);
+            if (nslow)
+                integrator.step(st, sz, vec, PACKET_SIZE, Xp, H, idsp, slow, cachep, true);
+            for (int j = 0; j < PACKET_SIZE; j++)
+            {
+                active[j] = fast[j] || slow[j];
+                safe[j]  -= active[j];
+            }
+            count[COUNT_FAST_STEPS] += nfast;
+            count[COUNT_STEPS]      += nfast + nslow;
+            if (steps_left)
+                used.fetch_add(nfast + nslow, memory_order_relaxed);
 
-                // debug
-//                 fmt::print(stderr, "gid {} enq to gid {}\n", cp.gid(), bid.gid);
+            for (int j = 0; j < PACKET_SIZE; j++)
+            {
+                size_t  i        = idx[j];
+                if (i == P.size())                  // empty lane
+                    continue;
 
-                if (IEXCHANGE)                          // enqueuing single endpoint allows fine-grain iexchange if desired
-                    cp.enqueue(bid, out_pt);
-                else
-                    outgoing_endpts[bid].push_back(out_pt); // vector of endpoints
+                int     reason   = EXIT_NONE;
+                if (active[j])
+                {
+                    P.nsteps[i]++;
+                    if (Integrator::adaptive)
+                        P.h[i] = H[j];
+                    if (Integrator::stochastic)
+                        ids[2][j] = P.nsteps[i];
+                    Pt next_p;
+                    next_p.coords[0] = X[0][j];
+                    next_p.coords[1] = X[1][j];
+                    next_p.coords[2] = X[2][j];
+                    const Pt& prev_p = segs[j].pts.back();
+                    float dx = next_p.coords[0] - prev_p.coords[0];
+                    float dy = next_p.coords[1] - prev_p.coords[1];
+                    float dz = next_p.coords[2] - prev_p.coords[2];
+                    float disp = sqrt(dx * dx + dy * dy + dz * dz);
+                    P.len[i] += disp;
+                    if (endpoints && segs[j].pts.size() == 2)
+                        segs[j].pts.back() = next_p;
+                    else
+                        segs[j].pts.push_back(next_p);
+                    if (P.nsteps[i] >= max_steps)
+                        reason    = EXIT_MAX_STEPS;
+                    else
+                        reason    = stop(j, i, next_p, disp);
+                    if (reason != EXIT_NONE)
+                        active[j] = 0;
+                }
+
+                if (!active[j])                     // lane is done with its particle
+                {
+                    if (thin)
+                        thin_segment(segs[j], P.nsteps[i] - (segs[j].pts.size() - 1), integ.decimate, integ.simplify,
+                                     keep, ranges);
+                    reason = end_segment(b, cp, decomposer, segs[j], i, reason, integ, nbrs, out, outgoing_endpts);
+                    if (reason != EXIT_NONE)
+                        count[COUNT_EXITS + reason]++;
+                    if (steps_left)
+                        finished[i] = 1;
+                    nactive--;
+                    idx[j] = P.size();
+                    load(j);
+                }
             }
         }
+
+        count[COUNT_CACHE_HITS]   = cache.hits;
+        count[COUNT_CACHE_MISSES] = cache.misses;
+        if (integ.miss_counters)
+        {
+            uint64_t misses[NUM_MISS_EVENTS];
+            CacheMissCounters::thread().read(misses);
+            count[COUNT_L1D_MISSES] = misses[L1D_MISSES] - misses0[L1D_MISSES];
+            count[COUNT_LLC_MISSES] = misses[LLC_MISSES] - misses0[LLC_MISSES];
+        }
+    };
+
+    // the pool is busy if another DIY thread is tracing a block with it; thread 0 then takes
+    // all the chunks, stealing them from the queues of the other threads
+    if (nthreads == 1 || !integ.workers->run(trace))
+        trace(0);
+
+    for (int t = 0; t < nthreads; t++)
+    {
+        if (t)
+            merge_output(b, cp, outputs[t], integ, outgoing_endpts);
+        for (int k = 0; k < NUM_COUNTS; k++)
+            b->counts[k] += counts[NUM_COUNTS * t + k];
+    }
+
+    if (!steps_left)
+        return true;
+    *steps_left -= min(used.load(), *steps_left);
+    P.erase_marked(finished);
+    return P.empty();
+}
+
+// instantiates trace_particles() for the integrator selected at runtime
+// with integ.sort_particles, sorts the particles by cell first
+// the neighbor lookup table of the block is built here, once per call
+bool trace_particles(Block*                             b,
+                     const diy::Master::ProxyWithLink&  cp,
+                     const Decomposer&                  decomposer,
+                     const int                          max_steps,
+                     const IntegratorParams&            integ,
+                     size_t*                            steps_left, // particle steps left, NULL = unlimited
+                     map<diy::BlockID, vector<EndPt> >& outgoing_endpts)
+{
+    diy::RegularLink<Bounds> *l = static_cast<diy::RegularLink<Bounds>*>(cp.link());
+    if (integ.sort_particles && b->particles.size() > PACKET_SIZE)
+    {
+        const int   st[3]   = {l->core().min[0],
+                               l->core().min[1],
+                               l->core().min[2]};
+        const int   sz[3]   = {l->core().max[0] - l->core().min[0] + 1,
+                               l->core().max[1] - l->core().min[1] + 1,
+                               l->core().max[2] - l->core().min[2] + 1};
+        b->particles.sort_by_cell(st, sz);
+    }
+
+    // destinations of the particles leaving the block, the same ones utl::in() would find
+    const utl::NeighborTable<Bounds> nbrs(*l, decomposer.domain);
+
+    switch (integ.type)
+    {
+    case RK4_INTEGRATOR:
+        return trace_particles(b, cp, decomposer, max_steps, RK4Integrator(integ), integ, nbrs, steps_left, outgoing_endpts);
+    case RK45_INTEGRATOR:
+        return trace_particles(b, cp, decomposer, max_steps, RK45Integrator(integ), integ, nbrs, steps_left, outgoing_endpts);
+    case BROWN_INTEGRATOR:
+        return trace_particles(b, cp, decomposer, max_steps, BrownIntegrator(integ), integ, nbrs, steps_left, outgoing_endpts);
+    default:
+        return trace_particles(b, cp, decomposer, max_steps, RK1Integrator(integ), integ, nbrs, steps_left, outgoing_endpts);
     }
 }
 
@@ -172,12 +747,7 @@ void deq_incoming_exchange(Block*                               b,
     for (int i = 0; i < in.size(); i++)
     {
         if (cp.incoming(in[i]).buffer.size() > 0)
-        {
-            vector<EndPt> incoming_endpts;
-            cp.dequeue(in[i], incoming_endpts);
-            for (size_t j = 0; j < incoming_endpts.size(); j++)
-                b->particles.push_back(incoming_endpts[j]);
-        }
+            recv_endpts(b, cp, in[i]);
     }
 }
 
@@ -189,20 +759,61 @@ void deq_incoming_iexchange(Block*                              b,
     {
         int nbr_gid = l->target(i).gid;
         while (cp.incoming(nbr_gid))
+            recv_endpts(b, cp, nbr_gid);
+    }
+}
+
+// coalesces the outgoing end points of iexchange per neighbor: moves them from outgoing to b->held,
+// and sends the ones held for a neighbor once their message is integ.min_queue_size bytes or more
+// (in the wire format of send_endpts(), without the header), or the
+// oldest of them has been held for integ.max_hold_time microseconds; with flush_all, sends all of them
+// end points are held only while the block has particles to trace, so the caller flushes all of them
+// when it is done
+void hold_endpts(Block*                             b,
+                 const diy::Master::ProxyWithLink&  cp,
+                 const IntegratorParams&            integ,
+                 map<diy::BlockID, vector<EndPt> >& outgoing_endpts,
+                 bool                               flush_all)
+{
+    double     now = MPI_Wtime();
+    WireFormat wf  = wire_format(integ);
+    for (map<diy::BlockID, vector<EndPt> >::iterator it = outgoing_endpts.begin(); it != outgoing_endpts.end(); it++)
+    {
+        HeldEndPts& h = b->held[it->first];
+        if (h.pts.empty())
+            h.since = now;
+        int ref[3];
+        wire_ref(cp, it->first.gid, ref);
+        for (size_t j = 0; j < it->second.size(); j++)
+            h.bytes += encoded_size(it->second[j], wf, ref, cp.gid());
+        h.pts.insert(h.pts.end(), it->second.begin(), it->second.end());
+    }
+    outgoing_endpts.clear();
+
+    for (map<diy::BlockID, HeldEndPts>::iterator it = b->held.begin(); it != b->held.end(); )
+    {
+        HeldEndPts& h = it->second;
+        if (flush_all                                           ||
+            h.bytes >= integ.min_queue_size                     ||
+            (now - h.since) * 1e6 >= integ.max_hold_time)
         {
-            EndPt incoming_endpt;
-            cp.dequeue(nbr_gid, incoming_endpt);
-            b->particles.push_back(incoming_endpt);
+            send_endpts(b, cp, integ, it->first, h.pts.data(), h.pts.size());
+            b->held.erase(it++);
         }
+        else
+            it++;
     }
 }
 
 // common to both exchange and iexchange
-void trace_block(Block*                              b,
+// returns whether all particles of the block are finished; with iexchange and integ.step_budget,
+// the particles not finished within the budget stay in b->particles for the next callback
+bool trace_block(Block*                              b,
                  const diy::Master::ProxyWithLink&   cp,
                  const Decomposer&                   decomposer,
                  const diy::Assigner&                assigner,
                  const int                           max_steps,
+                 const IntegratorParams&             integ,
                  const float                         seed_rate,
                  const Decomposer::BoolVector        share_face,
                  bool                                synth,
@@ -210,55 +821,65 @@ void trace_block(Block*                              b,
 {
     const int gid               = cp.gid();
     diy::RegularLink<Bounds> *l = static_cast<diy::RegularLink<Bounds>*>(cp.link());
-    b->particles.clear();
 
-    const int   st[3]   = {l->core().min[0],
-                           l->core().min[1],
-                           l->core().min[2]};
-    const int   sz[3]   = {l->core().max[0] - l->core().min[0] + 1,
-                           l->core().max[1] - l->core().min[1] + 1,
-                           l->core().max[2] - l->core().min[2] + 1};
+    // exchange: the particles of the pool were traced in the last round; iexchange: the pool keeps
+    // the particles suspended by the step budget for the next callback
+    if (!integ.iexchange)
+        b->particles.clear();
 
     // initialize seed particles first time
     if (b->init == 0)
         InitSeeds(b, gid, decomposer, l, seed_rate, synth);
 
     // dequeue incoming points and trace particles
-    if (IEXCHANGE)
+    if (integ.iexchange)
     {
+        size_t  budget  = integ.step_budget;    // particle steps left in this callback
+        size_t* budgetp = budget ? &budget : NULL;
         do
         {
             deq_incoming_iexchange(b, cp);
-            trace_particles(b, cp, decomposer, max_steps, outgoing_endpts);
+            bool all = trace_particles(b, cp, decomposer, max_steps, integ, budgetp, outgoing_endpts);
+            hold_endpts(b, cp, integ, outgoing_endpts, false);
+            if (!all)
+                return false;                   // out of budget, DIY calls back for the rest
             b->particles.clear();
-        } while (cp.fill_incoming());
+        } while ((!budgetp || budget) && cp.fill_incoming());
+        bool done = !budgetp || budget;         // used up exactly: incoming particles may be waiting
+        hold_endpts(b, cp, integ, outgoing_endpts, done);
+        return done;
     }
     else
     {
         deq_incoming_exchange(b, cp);
-        trace_particles(b, cp, decomposer, max_steps, outgoing_endpts);
+        trace_particles(b, cp, decomposer, max_steps, integ, NULL, outgoing_endpts);
+        return true;
     }
 }
 
-void trace_block_exchange(Block*                              b,
-                          const diy::Master::ProxyWithLink&   cp,
-                          const Decomposer&                   decomposer,
-                          const diy::Assigner&                assigner,
-                          const int                           max_steps,
-                          const float                         seed_rate,
-                          const Decomposer::BoolVector        share_face,
-                          bool                                synth)
+// returns the number of end points sent, i.e., of particles to be traced in the next round
+size_t trace_block_exchange(Block*                            b,
+                            const diy::Master::ProxyWithLink& cp,
+                            const Decomposer&                 decomposer,
+                            const diy::Assigner&              assigner,
+                            const int                         max_steps,
+                            const IntegratorParams&           integ,
+                            const float                       seed_rate,
+                            const Decomposer::BoolVector      share_face,
+                            bool                              synth)
 {
     map<diy::BlockID, vector<EndPt> > outgoing_endpts;
 
-    trace_block(b, cp, decomposer, assigner, max_steps, seed_rate, share_face, synth, outgoing_endpts);
+    trace_block(b, cp, decomposer, assigner, max_steps, integ, seed_rate, share_face, synth, outgoing_endpts);
 
     // enqueue the vectors of endpoints
+    size_t nsent = 0;
     for (map<diy::BlockID, vector<EndPt> >::const_iterator it = outgoing_endpts.begin(); it != outgoing_endpts.end(); it++)
-        cp.enqueue(it->first, it->second);
-
-    // stage all_reduce of total initialized and total finished particle traces
-    cp.all_reduce(b->particles.size(), plus<size_t>());
+    {
+        send_endpts(b, cp, integ, it->first, it->second.data(), it->second.size());
+        nsent += it->second.size();
+    }
+    return nsent;
 }
 
 bool trace_block_iexchange(Block*                               b,
@@ -266,13 +887,13 @@ bool trace_block_iexchange(Block*                               b,
                            const Decomposer&                    decomposer,
                            const diy::Assigner&                 assigner,
                            const int                            max_steps,
+                           const IntegratorParams&              integ,
                            const float                          seed_rate,
                            const Decomposer::BoolVector         share_face,
                            int                                  synth)
 {
     map<diy::BlockID, vector<EndPt> > outgoing_endpts;  // needed to call trace_particles() but otherwise unused in iexchange
-    trace_block(b, cp, decomposer, assigner, max_steps, seed_rate, share_face, synth, outgoing_endpts);
-    return true;
+    return trace_block(b, cp, decomposer, assigner, max_steps, integ, seed_rate, share_face, synth, outgoing_endpts);
 }
 
 // merge traces at the root block
@@ -287,12 +908,15 @@ void merge_traces(void* b_, const diy::ReduceProxy& rp, const diy::RegularMergeP
         if (nbr_gid == rp.gid())                    // skip self
             continue;
 
-        vector<Segment> in_traces;
-        rp.dequeue(nbr_gid, in_traces);
-
-        // append in_traces to segments, leaving trajectories segmented and disorganized
+        // append incoming traces to segments, leaving trajectories segmented and disorganized
         // eventually could sort into continuous long trajectories, but not necessary at this time
-        b->segments.insert(b->segments.end(), in_traces.begin(), in_traces.end());
+        // both are read straight from the incoming buffer into the ends of the arrays of the block
+        diy::MemoryBuffer& in = rp.incoming(nbr_gid);
+        b->segments.append(in);
+        size_t n, m = b->summaries.size();
+        diy::load(in, n);
+        b->summaries.resize(m + n);
+        diy::load(in, b->summaries.data() + m, n);
     }
 
     // enqueue
@@ -300,7 +924,11 @@ void merge_traces(void* b_, const diy::ReduceProxy& rp, const diy::RegularMergeP
     {
         int nbr_gid = rp.out_link().target(0).gid;  // for a merge, the out_link size is 1; ie, there is only one target
         if (nbr_gid != rp.gid())                    // skip self
+        {
             rp.enqueue(rp.out_link().target(0), b->segments);
+            rp.enqueue(rp.out_link().target(0), b->summaries.size());
+            rp.enqueue(rp.out_link().target(0), b->summaries.data(), b->summaries.size());
+        }
     }
 }
 
@@ -391,12 +1019,15 @@ void update_stats(
         int                             trial,
         double                          time_start,
         int                             ncalls,
+        const size_t*                   counts,         // TraceCount counters of this rank
         const diy::mpi::communicator&   world,
         Stats&                          stats)
 {
     double cur_time = MPI_Wtime() - time_start;
     int cur_ncalls  = 0;
     MPI_Reduce(&ncalls, &cur_ncalls, 1, MPI_INT, MPI_SUM, 0, world);
+    size_t cur_counts[NUM_COUNTS] = { 0 };
+    MPI_Reduce((void*)counts, cur_counts, NUM_COUNTS, MPI_UNSIGNED_LONG, MPI_SUM, 0, world);
 
     if (trial == 0)
     {
@@ -408,6 +1039,8 @@ void update_stats(
         stats.prev_mean_callback_time     = stats.cur_callback_time;
         stats.cur_std_time                = 0.0;
         stats.cur_std_ncalls              = 0.0;
+        for (int i = 0; i < NUM_COUNTS; i++)
+            stats.counts[i]               = 0;
     }
     else
     {
@@ -427,6 +1060,8 @@ void update_stats(
     stats.prev_mean_callback_time     = stats.cur_mean_callback_time;
     stats.prev_std_time               = stats.cur_std_time;
     stats.prev_std_ncalls             = stats.cur_std_ncalls;
+    for (int i = 0; i < NUM_COUNTS; i++)
+        stats.counts[i]              += cur_counts[i];
 
     // debug
 //     if (world.rank() == 0)
@@ -442,14 +1077,18 @@ void print_results(
         int             nblocks,
         int             tot_nsynth,
         int             ntrials,
-        int             nrounds,
+        int             nrounds,                // of the last trial
+        int             tot_nrounds,            // over all trials
+        int             mode,                   // ExchangeMode
+        bool            pipelined,
         const Stats&    stats)
 {
     fmt::print(stderr, "---------- stats ----------\n");
-    if (IEXCHANGE)
+    if (mode == IEXCHANGE_MODE)
         fmt::print(stderr, "using iexchange\n");
     else
-        fmt::print(stderr, "using exchange\n");
+        fmt::print(stderr, "using {}{}\n", mode == HYBRID_MODE ? "exchange, then iexchange for the tail" : "exchange",
+                   pipelined ? ", termination test pipelined with tracing" : "");
     fmt::print(stderr, "seed rate:                       {}\n", seed_rate);
     fmt::print(stderr, "nprocs:                          {}\n", nprocs);
     fmt::print(stderr, "nblocks:                         {}\n", nblocks);
@@ -457,16 +1096,48 @@ void print_results(
     fmt::print(stderr, "ntrials:                         {}\n", ntrials);
     fmt::print(stderr, "mean time (s):                   {}\n", stats.cur_mean_time);
     fmt::print(stderr, "std dev time (s):                {}\n", ntrials > 1 ? sqrt(stats.cur_std_time / (ntrials - 1)) : 0.0);
-    if (IEXCHANGE)
+    if (mode != EXCHANGE_MODE)
     {
         fprintf(stderr,    "mean # callbacks:                %.0lf\n",  stats.cur_mean_ncalls);
         fprintf(stderr,    "std dev # callbacks:             %.0lf\n",  ntrials > 1 ? sqrt(stats.cur_std_ncalls / (ntrials - 1)) : 0.0);
     }
-    else
+    if (mode != IEXCHANGE_MODE)
     {
         fmt::print(stderr, "# rounds:                        {}\n",     nrounds);
         fmt::print(stderr, "mean callback (advect) time (s): {}\n",     stats.cur_mean_callback_time);
     }
+    const size_t* c = stats.counts;
+    if (c[COUNT_CACHE_HITS] + c[COUNT_CACHE_MISSES])
+        fprintf(stderr,    "cell cache hit rate:             %.1lf%% of %lu interpolations\n",
+                100.0 * c[COUNT_CACHE_HITS] / (c[COUNT_CACHE_HITS] + c[COUNT_CACHE_MISSES]),
+                c[COUNT_CACHE_HITS] + c[COUNT_CACHE_MISSES]);
+    if (c[COUNT_STEPS])
+        fprintf(stderr,    "steps without bounds checks:     %.1lf%% of %lu steps\n",
+                100.0 * c[COUNT_FAST_STEPS] / c[COUNT_STEPS], c[COUNT_STEPS]);
+    if (c[COUNT_STEPS] && c[COUNT_L1D_MISSES] + c[COUNT_LLC_MISSES])
+        fprintf(stderr,    "L1D / LLC load misses per step:  %.2lf / %.3lf\n",
+                (double)c[COUNT_L1D_MISSES] / c[COUNT_STEPS], (double)c[COUNT_LLC_MISSES] / c[COUNT_STEPS]);
+    if (c[COUNT_MESSAGES])
+    {
+        fprintf(stderr,    "end point messages sent:         %lu, %.0lf bytes on average\n",
+                c[COUNT_MESSAGES], (double)c[COUNT_MESSAGE_BYTES] / c[COUNT_MESSAGES]);
+        fprintf(stderr,    "bytes per end point sent:        %.1lf (%lu end points)\n",
+                (double)c[COUNT_MESSAGE_BYTES] / c[COUNT_ENDPTS_SENT], c[COUNT_ENDPTS_SENT]);
+        if (mode == EXCHANGE_MODE)
+            fprintf(stderr,    "end point bytes per round:       %.0lf\n",
+                    (double)c[COUNT_MESSAGE_BYTES] / tot_nrounds);
+    }
+    size_t nfinished = 0;
+    for (int r = EXIT_DOMAIN; r < NUM_EXIT_REASONS; r++)
+        nfinished += c[COUNT_EXITS + r];
+    if (nfinished)
+        fprintf(stderr,    "hand-offs / msgs per particle:   %.2lf / %.2lf\n",
+                (double)c[COUNT_ENDPTS_SENT] / nfinished, (double)c[COUNT_MESSAGES] / nfinished);
+    static const char* exit_names[NUM_EXIT_REASONS] =
+        { "", "domain", "max steps", "min speed", "min disp", "cell steps" };
+    for (int r = EXIT_DOMAIN; r < NUM_EXIT_REASONS; r++)
+        if (c[COUNT_EXITS + r])
+            fprintf(stderr,    "particles ended by %-14s%lu\n", (string(exit_names[r]) + ":").c_str(), c[COUNT_EXITS + r]);
     fmt::print(stderr, "---------------------------\n");
 }
 
@@ -485,8 +1156,8 @@ void print_exceeded_max_rounds(diy::Master& master)
             fmt::print(stderr, "  core = {} - {}, bounds = {} - {}\n",
                     l->core().min,   l->core().max,
                     l->bounds().min, l->bounds().max);
-            for (auto& p : b->particles)
-                fmt::print(stderr, "  {}\n", p.pt.coords);
+            for (size_t i = 0; i < b->particles.size(); i++)
+                fmt::print(stderr, "  {}\n", b->particles[i].pt.coords);
         }
     });
 }
@@ -522,10 +1193,15 @@ void render_traces(
 
 #endif
 
+// names of the output files of each ExchangeMode
+const char* exchange_mode_names[NUM_EXCHANGE_MODES] = { "exchange", "iexchange", "hybrid" };
+
 void write_traces(
         diy::Master&        master,
         diy::Assigner&      assigner,
-        Decomposer&         decomposer)
+        Decomposer&         decomposer,
+        int                 mode,                   // ExchangeMode
+        bool                endpoints)              // write particle summaries instead of segments
 {
     // merge-reduce traces to one block
     int k = 2;                               // the radix of the k-ary reduction tree
@@ -535,33 +1211,23 @@ void write_traces(
     if (master.communicator().rank() == 0)
     {
         fprintf(stderr, "Check is turned on: merging traces to one block and writing them to disk\n");
-        std::string filename;
-        if (IEXCHANGE)
-            filename = "iexchange.txt";
+        std::string filename = exchange_mode_names[mode];
+        if (endpoints)
+            ((Block*)master.block(0))->write_summaries(filename + "-endpoints.txt");
         else
-            filename = "exchange.txt";
-        ((Block*)master.block(0))->write_segments(filename);
+            ((Block*)master.block(0))->write_segments(filename + ".txt");
     }
 }
 
 void output_profile(
         diy::Master&            master,
-        int                     nblocks)
+        int                     nblocks,
+        int                     mode)           // ExchangeMode
 {
-    if (IEXCHANGE)
-    {
-        diy::io::SharedOutFile prof_out(fmt::format("profile-iexchange-p{}-b{}.txt",
-                    master.communicator().size(), nblocks), master.communicator());
-        master.prof.output(prof_out, std::to_string(master.communicator().rank()));
-        prof_out.close();
-    }
-    else
-    {
-        diy::io::SharedOutFile prof_out(fmt::format("profile-exchange-p{}-b{}.txt",
-                    master.communicator().size(), nblocks), master.communicator());
-        master.prof.output(prof_out, std::to_string(master.communicator().rank()));
-        prof_out.close();
-    }
+    diy::io::SharedOutFile prof_out(fmt::format("profile-{}-p{}-b{}.txt", exchange_mode_names[mode],
+                master.communicator().size(), nblocks), master.communicator());
+    master.prof.output(prof_out, std::to_string(master.communicator().rank()));
+    prof_out.close();
 }
 
 int main(int argc, char **argv)
@@ -584,9 +1250,12 @@ int main(int argc, char **argv)
     int mblocks             = -1;               // number of blocks in memory (-1 = all)
     string prefix           = "./DIY.XXXXXX";   // storage of temp files
     int ndims               = 3;                // domain dimensions
+    int ghost               = 1;                // width of the ghost layer around each block
     float vec_scale         = 1.0;              // vector field scaling factor
     int hdr_bytes           = 0;                // num bytes header before start of data in infile
     int max_rounds          = 0;                // max number of rounds to trace (0 = no limit)
+    int mode                = EXCHANGE_MODE;    // how the blocks exchange particles
+    size_t hybrid_threshold = 0;                // end points in flight below which hybrid switches to iexchange
     size_t min_queue_size   = 0;                // min queue size (bytes) for iexchange
     size_t max_hold_time    = 0;                // max hold time (microsec) for iexchange
     int synth               = 0;                // generate various synthetic input datasets
@@ -598,6 +1267,27 @@ int main(int argc, char **argv)
     bool merged_traces      = false;            // traces have already been merged to one block
     int tot_nsynth          = nblocks;          // total number of synthetic slow velocity regions
     bool barrier            = false;            // everybody issues a barrier in the beginning
+    int layout              = SOA_LAYOUT;       // velocity storage layout
+    int precision           = FP32_PRECISION;   // velocity storage precision
+    int integrator          = RK1_INTEGRATOR;   // integration method
+    float step              = 0.5;              // step size (initial step size for adaptive RK45)
+    float tol               = 1e-3;             // error tolerance per step for adaptive RK45
+    int cell_cache          = 1;                // cache cell corners per lane in the interpolations
+    int fast_path           = 1;                // skip bounds checks for steps that cannot leave the block
+    int endpoints           = 0;                // keep only a summary of each particle, no trajectories
+    int decimate            = 1;                // keep every decimate-th trajectory point
+    float simplify          = 0.0;              // error bound of trajectory simplification (0 = off)
+    float quantum           = 0.0;              // quantization step of stored trajectory points (0 = float)
+    int trace_threads       = 1;                // threads tracing the particles of one block
+    int sort_particles      = 1;                // sort the particles by cell before tracing them
+    int miss_counters       = 0;                // count hardware cache misses while tracing
+    float min_speed         = 0.0;              // terminate particles slower than this (0 = off)
+    int window              = 0;                // terminate particles moving less than min_disp in window steps (0 = off)
+    float min_disp          = 0.0;
+    int cell_steps          = 0;                // terminate particles after this many steps in one cell (0 = off)
+    size_t step_budget      = 0;                // max. particle steps per iexchange callback (0 = unlimited)
+    float wire_quantum      = 0.0;              // quantization step of exchanged end point coordinates (0 = float)
+    unsigned seed           = 0;                // random seed for Brownian advection
 
     // command-line ags
     Options ops(argc, argv);
@@ -609,6 +1299,8 @@ int main(int argc, char **argv)
         >> Option('v', "vec-scale",     vec_scale,      "Vector field scaling factor")
         >> Option('h', "hdr-bytes",     hdr_bytes,      "Skip this number bytes header in infile")
         >> Option('r', "max-rounds",    max_rounds,     "Max number of rounds to trace")
+        >> Option('e', "exchange",      mode,           "Exchange mode (0 = rounds of exchange, 1 = iexchange, 2 = hybrid: rounds, then iexchange for the tail)")
+        >> Option(     "hybrid-threshold", hybrid_threshold, "Hybrid: switch to iexchange once fewer particles are in flight (0 = 64 per block)")
         >> Option('x', "synthetic",     synth,          "Generate various synthetic flows")
         >> Option('w', "slow-vel",      slow_vel,       "Slow velocity for synthetic data")
         >> Option('f', "fast-vel",      fast_vel,       "Fast velocity for synthetic data")
@@ -616,9 +1308,35 @@ int main(int argc, char **argv)
         >> Option('l', "log",           log_level,      "log level")
         >> Option('n', "trials",        ntrials,        "number of trials")
         >> Option('o', "nsynth",        tot_nsynth,     "total number of synthetic velocity regions")
+        >> Option(     "ghost",         ghost,          "Width of the ghost layer around each block, which particles trace through before they are handed off")
         >> Option(     "barrier",       barrier,        "initial barrier")
+        >> Option(     "min-queue-size", min_queue_size, "iexchange: bytes of end points to coalesce per neighbor before sending (as sent, in the wire format)")
+        >> Option(     "max-hold-time", max_hold_time,  "iexchange: max. microseconds to hold end points for coalescing")
+        >> Option(     "wire-quantum",  wire_quantum,   "Send end point coordinates as multiples of this step from the receiving block (0 = float)")
+        >> Option(     "integrator",    integrator,     "Integrator (0 = RK1, 1 = RK4, 2 = adaptive RK45, 3 = Brownian)")
+        >> Option(     "step",          step,           "Step size (initial step size for adaptive RK45)")
+        >> Option(     "tol",           tol,            "Error tolerance per step for adaptive RK45")
+        >> Option(     "seed",          seed,           "Random seed for Brownian advection")
+        >> Option(     "cell-cache",    cell_cache,     "Cache cell corners per particle in the interpolations (0 = off)")
+        >> Option(     "fast-path",     fast_path,      "Skip bounds checks for steps that cannot leave the block (0 = off)")
+        >> Option(     "endpoints",     endpoints,      "Keep only seed and final point, arc length, steps, and exit reason of each particle (1 = on)")
+        >> Option(     "decimate",      decimate,       "Keep only every n-th trajectory point")
+        >> Option(     "simplify",      simplify,       "Drop trajectory points within this distance of the simplified polyline (0 = off)")
+        >> Option(     "quantum",       quantum,        "Store trajectory points as delta-encoded multiples of this step (0 = float)")
+        >> Option(     "trace-threads", trace_threads,  "Threads tracing the particles of one block, including the calling DIY thread")
+        >> Option(     "sort-particles", sort_particles, "Sort the particles of a block by the Morton code of their cell before tracing (0 = off)")
+        >> Option(     "miss-counters", miss_counters,  "Count L1D and LLC load misses while tracing (Linux perf events, 1 = on)")
+        >> Option(     "min-speed",     min_speed,      "Terminate particles where the speed drops below this (0 = off)")
+        >> Option(     "window",        window,         "Terminate particles moving less than min-disp in each window of this many steps (0 = off)")
+        >> Option(     "min-disp",      min_disp,       "Min. displacement over a window of steps")
+        >> Option(     "cell-steps",    cell_steps,     "Terminate particles after this many consecutive steps in one cell (0 = off)")
+        >> Option(     "step-budget",   step_budget,    "Max. particle steps per iexchange callback, the rest is traced in later callbacks (0 = unlimited)")
+        >> Option(     "layout",        layout,         "Velocity layout (0 = separate vx, vy, vz arrays, 1 = interleaved xyz, 2 = 4^3 bricks)")
+        >> Option(     "precision",     precision,      "Velocity precision (0 = float, 1 = half float, 2 = bfloat16, 3 = int16 quantized per block)")
         ;
     bool fine = ops >> Present("fine", "Use fine-grain icommunicate");
+    bool raw_endpts = ops >> Present("raw-endpts", "Send end points as arrays copied in blocks, instead of compact");
+    bool pipelined  = ops >> Present("pipelined", "exchange: overlap the termination test of each round with tracing the next one");
 
     if (ops >> Present('h', "help", "show help") ||
             !(ops >> PosOption(infile) >> PosOption(max_steps) >> PosOption(seed_rate)
@@ -633,6 +1351,53 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (integrator < 0 || integrator >= NUM_INTEGRATORS)
+    {
+        if (world.rank() == 0)
+            fprintf(stderr, "Unknown integrator %d\n", integrator);
+        return 1;
+    }
+    if (mode < 0 || mode >= NUM_EXCHANGE_MODES)
+    {
+        if (world.rank() == 0)
+            fprintf(stderr, "Unknown exchange mode %d\n", mode);
+        return 1;
+    }
+    if (hybrid_threshold == 0)
+        hybrid_threshold = nblocks * PACKET_SIZE;
+    if (ghost < 0)
+    {
+        if (world.rank() == 0)
+            fprintf(stderr, "Negative ghost width %d\n", ghost);
+        return 1;
+    }
+    IntegratorParams integ;
+    integ.type       = integrator;
+    integ.h          = step;
+    integ.tol        = tol;
+    integ.h_min      = step / 64;
+    integ.h_max      = step * 8;
+    integ.cell_cache = cell_cache;
+    integ.fast_path  = fast_path;
+    integ.endpoints  = endpoints;
+    integ.decimate   = decimate;
+    integ.simplify   = simplify;
+    integ.seed       = seed;
+    integ.min_speed  = min_speed;
+    integ.window     = window;
+    integ.min_disp   = min_disp;
+    integ.cell_steps = cell_steps;
+    integ.step_budget = step_budget;
+    integ.min_queue_size = min_queue_size;
+    integ.max_hold_time  = max_hold_time;
+    integ.fine           = fine;
+    integ.wire_quantum   = wire_quantum;
+    integ.raw_endpts     = raw_endpts;
+    integ.sort_particles = sort_particles;
+    integ.miss_counters  = miss_counters;
+    WorkerPool workers(trace_threads);
+    integ.workers    = trace_threads > 1 ? &workers : NULL;
+
 //     diy::create_logger(log_level);
     diy::FileStorage             storage(prefix);
     diy::Master                  master(world,
@@ -649,7 +1414,7 @@ int main(int argc, char **argv)
     Decomposer::BoolVector       share_face;
     Decomposer::BoolVector       wrap;       // defaults to false
     Decomposer::CoordinateVector ghosts;
-    ghosts.push_back(1); ghosts.push_back(1); ghosts.push_back(1);
+    ghosts.push_back(ghost); ghosts.push_back(ghost); ghosts.push_back(ghost);
     share_face.push_back(true); share_face.push_back(true); share_face.push_back(true);
 
     Decomposer decomposer(ndims,
@@ -660,12 +1425,12 @@ int main(int argc, char **argv)
                           ghosts);
     if (synth == 1)
     {
-        AddConsistentSynthetic addsynth(master, slow_vel, fast_vel, tot_nsynth);
+        AddConsistentSynthetic addsynth(master, slow_vel, fast_vel, tot_nsynth, layout, precision);
         decomposer.decompose(world.rank(), assigner, addsynth);
     }
     else
     {
-        AddAndRead addblock(master, infile.c_str(), world, vec_scale, hdr_bytes);
+        AddAndRead addblock(master, infile.c_str(), world, vec_scale, hdr_bytes, layout, precision);
         decomposer.decompose(world.rank(), assigner, addblock);
     }
 
@@ -677,8 +1442,43 @@ int main(int argc, char **argv)
             fprintf(stderr, "input vectors read from file %s\n", infile.c_str());
     }
 
+    // velocity storage of the largest rank, and the part of all of it in the ghost layers
+    // the hand-off point of a particle, past the ghost layer, must be in the core of an adjacent block
+    size_t vel_bytes = 0, max_vel_bytes, bytes[2] = { 0, 0 }, tot_bytes[2];
+    int min_core = INT_MAX, tot_min_core;       // smallest core extent of any block in any dimension
+    master.foreach([&](Block* b, const diy::Master::ProxyWithLink& cp)
+            {
+                diy::RegularLink<Bounds> *l = static_cast<diy::RegularLink<Bounds>*>(cp.link());
+                size_t core_size = 1, bounds_size = 1;
+                for (int i = 0; i < ndims; i++)
+                {
+                    core_size   *= l->core().max[i] - l->core().min[i] + 1;
+                    bounds_size *= l->bounds().max[i] - l->bounds().min[i] + 1;
+                    min_core     = min(min_core, l->core().max[i] - l->core().min[i]);
+                }
+                vel_bytes += b->vel_bytes();
+                bytes[0]  += b->vel_bytes();
+                bytes[1]  += (size_t)((double)b->vel_bytes() * (bounds_size - core_size) / bounds_size);
+            });
+    MPI_Reduce(&vel_bytes, &max_vel_bytes, 1, MPI_UNSIGNED_LONG, MPI_MAX, 0, world);
+    MPI_Reduce(bytes, tot_bytes, 2, MPI_UNSIGNED_LONG, MPI_SUM, 0, world);
+    MPI_Allreduce(&min_core, &tot_min_core, 1, MPI_INT, MPI_MIN, world);
+    if (world.rank() == 0)
+        fprintf(stderr, "max velocity storage per rank %.1f MB (precision %d), %.1f%% of all in ghost layers of width %d\n",
+                max_vel_bytes / 1048576.0, precision, tot_bytes[0] ? 100.0 * tot_bytes[1] / tot_bytes[0] : 0.0, ghost);
+    if (ghost >= tot_min_core)
+    {
+        if (world.rank() == 0)
+            fprintf(stderr, "Ghost width %d must be smaller than the blocks (%d)\n", ghost, tot_min_core);
+        return 1;
+    }
+
     Stats stats;                        // incremental stats, default initialized to 0's
+    Pt origin { { (float)domain.min[0], (float)domain.min[1], (float)domain.min[2] } };   // of quantized trajectories
     int nrounds;
+    int tot_nrounds = 0;                // over all trials
+    MPI_Comm term_comm;                 // termination tests of exchange, apart from the collectives of DIY
+    MPI_Comm_dup(world, &term_comm);
 
     // check if clocks are synchronized by printing the value of MPI_WTIME_IS_GLOBAL and timing an initial barrier
     // barrier also has the effect of removing any skew in generating or reading the data
@@ -707,19 +1507,24 @@ int main(int argc, char **argv)
         // reset the block particle traces, but leave the vector field intact
         master.foreach([&](Block* b, const diy::Master::ProxyWithLink& cp)
                 {
-                    b->init     = 0;
-                    b->done     = 0;
+                    b->init         = 0;
+                    b->done         = 0;
+                    for (int i = 0; i < NUM_COUNTS; i++)
+                        b->counts[i] = 0;
                     b->segments.clear();
+                    b->segments.set_quantum(quantum, origin);
+                    b->summaries.clear();
                     b->particles.clear();
+                    b->held.clear();
                 });
 
         if (barrier)
             world.barrier();
         double time_start = MPI_Wtime();
 
-        if (IEXCHANGE)
+        // combined advection and exchange
+        auto trace_iexchange = [&]()
         {
-            // combined advection and exchange
             master.iexchange([&](Block* b, const diy::Master::ProxyWithLink& icp) -> bool
             {
                 ncalls++;
@@ -728,20 +1533,37 @@ int main(int argc, char **argv)
                            decomposer,
                            assigner,
                            max_steps,
+                           integ,
                            seed_rate,
                            share_face,
                            synth);
                 return val;
             });
-        }
-        else    // exchange
+        };
+
+        integ.iexchange = (mode == IEXCHANGE_MODE);
+        nrounds         = 0;
+        if (mode == IEXCHANGE_MODE)
+            trace_iexchange();
+        else    // exchange, or hybrid
         {
             // particle tracing for either a maximum number of rounds or, if max_rounds == 0,
             // then for inifinitely many rounds until breaking out when done is true
             int stop = (max_rounds ? max_rounds : 1);
             int incr = (max_rounds ? 1 : 0);
 
-            nrounds                 = 0;
+            // all particles are done when no end points are in flight, i.e., when the sum over all
+            // blocks of all ranks of the end points sent in a round is 0
+            // with pipelined, the sum of each round is a nonblocking reduction that completes while
+            // the next round is traced; it is only waited for before the exchange of the next round,
+            // which has nothing to trace and nothing to send if the sum is 0
+            // hybrid switches to iexchange for the tail once fewer than hybrid_threshold end points are
+            // in flight, by the last sum known (with pipelined, the one of the previous round)
+            size_t      nsent, tot_nsent = 0;   // end points sent in the last round, by this rank and by all
+            size_t      in_flight = 0;          // the last sum known
+            MPI_Request req = MPI_REQUEST_NULL;
+            bool        tail = false;           // switching to iexchange
+
             stats.cur_callback_time = 0.0;
             for (int round = 0; round < stop; round += incr)
             {
@@ -749,33 +1571,75 @@ int main(int argc, char **argv)
 
                 // advect
                 double t0 = MPI_Wtime();
+                atomic<size_t> round_nsent(0);
                 master.foreach([&](Block* b, const diy::Master::ProxyWithLink& cp)
                 {
-                    trace_block_exchange(b,
-                                         cp,
-                                         decomposer,
-                                         assigner,
-                                         max_steps,
-                                         seed_rate,
-                                         share_face,
-                                         synth);
+                    round_nsent += trace_block_exchange(b,
+                                                        cp,
+                                                        decomposer,
+                                                        assigner,
+                                                        max_steps,
+                                                        integ,
+                                                        seed_rate,
+                                                        share_face,
+                                                        synth);
                 });
                 stats.cur_callback_time += (MPI_Wtime() - t0);
 
+                if (req != MPI_REQUEST_NULL)
+                {
+                    MPI_Wait(&req, MPI_STATUS_IGNORE);
+                    in_flight = tot_nsent;
+                    if (in_flight == 0)
+                    {
+                        nrounds--;              // this round traced nothing
+                        break;
+                    }
+                }
+
                 // exchange
                 master.exchange();
 
                 // determine if all particles are done
-                size_t remaining;
-                for (int i = 0; i < master.size(); i++)
-                    remaining = master.proxy(i).get<size_t>();
-                if (remaining == 0)
+                nsent = round_nsent;
+                if (pipelined)
+                    MPI_Iallreduce(&nsent, &tot_nsent, 1, MPI_UNSIGNED_LONG, MPI_SUM, term_comm, &req);
+                else
+                {
+                    MPI_Allreduce(&nsent, &tot_nsent, 1, MPI_UNSIGNED_LONG, MPI_SUM, term_comm);
+                    in_flight = tot_nsent;
+                    if (in_flight == 0)
+                        break;
+                }
+
+                if (mode == HYBRID_MODE && (!pipelined || nrounds > 1) && in_flight < hybrid_threshold)
+                {
+                    tail = true;
                     break;
+                }
             }   // rounds
+            if (req != MPI_REQUEST_NULL)        // stopped by max_rounds, or switching
+            {
+                MPI_Wait(&req, MPI_STATUS_IGNORE);
+                in_flight = tot_nsent;
+            }
 
             // debug: exceeded number of rounds for exchange
             if (nrounds == max_rounds)
                 print_exceeded_max_rounds(master);
+
+            // the end points of the last round were exchanged, but not dequeued yet; iexchange
+            // traces the particles of the blocks in its first callbacks
+            if (tail && in_flight)
+            {
+                master.foreach([&](Block* b, const diy::Master::ProxyWithLink& cp)
+                {
+                    b->particles.clear();
+                    deq_incoming_exchange(b, cp);
+                });
+                integ.iexchange = true;
+                trace_iexchange();
+            }
         }
 
         world.barrier();
@@ -785,24 +1649,42 @@ int main(int argc, char **argv)
             fprintf(stderr, "finished particle tracing trial %d\n", trial);
 //         master.prof.totals().output(std::cerr);
 
-        update_stats(trial, time_start, ncalls, world, stats);
+        size_t counts[NUM_COUNTS] = { 0 };
+        master.foreach([&](Block* b, const diy::Master::ProxyWithLink& cp)
+                {
+                    for (int i = 0; i < NUM_COUNTS; i++)
+                        counts[i] += b->counts[i];
+                });
+        update_stats(trial, time_start, ncalls, counts, world, stats);
+        tot_nrounds += nrounds;
 
 #ifdef WITH_VTK
         render_traces(master, assigner, decomposer, true);
 #endif
 
 #ifdef DIY_PROFILE
-        output_profile(master, nblocks);
+        output_profile(master, nblocks, mode);
 #endif
 
     }           // number of trials
 
+    // trajectory storage of the largest rank, after the last trial
+    size_t trace_bytes = 0, max_trace_bytes;
+    master.foreach([&](Block* b, const diy::Master::ProxyWithLink& cp)
+            {
+                trace_bytes += b->trace_bytes();
+            });
+    MPI_Reduce(&trace_bytes, &max_trace_bytes, 1, MPI_UNSIGNED_LONG, MPI_MAX, 0, world);
+    if (world.rank() == 0)
+        fprintf(stderr, "max trace storage per rank %.1f MB (%s)\n", max_trace_bytes / 1048576.0,
+                endpoints ? "endpoints" : "trajectories");
+
     if (world.rank() == 0)
-        print_results(seed_rate, world.size(), nblocks, tot_nsynth, ntrials, nrounds, stats);
+        print_results(seed_rate, world.size(), nblocks, tot_nsynth, ntrials, nrounds, tot_nrounds, mode, pipelined, stats);
 
     // write trajectory segments for validation
     if (check)
-        write_traces(master, assigner, decomposer);
+        write_traces(master, assigner, decomposer, mode, endpoints);
 
     // debug
 //     master.foreach([&](Block* b, const diy::Master::ProxyWithLink& cp)
@@ -810,5 +1692,6 @@ int main(int argc, char **argv)
 //         b->show_geometry(cp);
 //     });
 
+    MPI_Comm_free(&term_comm);
     return 0;
 }
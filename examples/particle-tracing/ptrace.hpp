@@ -20,12 +20,54 @@
 #include <diy/partners/merge.hpp>
 #include <diy/point.hpp>
 
+#include <stdint.h>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+
 using namespace std;
 
 typedef diy::DiscreteBounds            Bounds;
 typedef diy::RegularGridLink           RGLink;
 typedef diy::RegularDecomposer<Bounds> Decomposer;
 
+// how the blocks exchange the particles leaving them
+enum ExchangeMode
+{
+    EXCHANGE_MODE       = 0,                // synchronous rounds of master.exchange()
+    IEXCHANGE_MODE      = 1,                // master.iexchange()
+    HYBRID_MODE         = 2,                // rounds while many particles are in flight, then iexchange
+    NUM_EXCHANGE_MODES
+};
+
+// why a particle stopped being traced
+enum ExitReason
+{
+    EXIT_NONE       = 0,                     // still being traced
+    EXIT_DOMAIN     = 1,                     // left the domain
+    EXIT_MAX_STEPS  = 2,                     // reached the max. number of steps
+    EXIT_MIN_SPEED  = 3,                     // velocity dropped below the min. speed
+    EXIT_MIN_DISP   = 4,                     // moved less than the min. displacement over a window of steps
+    EXIT_CELL_STEPS = 5,                     // took the max. number of consecutive steps in one cell
+    NUM_EXIT_REASONS
+};
+
+// counters of particle tracing, per block for the current trial and in Stats summed over trials
+enum TraceCount
+{
+    COUNT_CACHE_HITS    = 0,                // cell cache hits and misses
+    COUNT_CACHE_MISSES  = 1,
+    COUNT_FAST_STEPS    = 2,                // particle steps taken without bounds checks
+    COUNT_STEPS         = 3,                // all particle steps
+    COUNT_L1D_MISSES    = 4,                // hardware L1D and LLC load misses while tracing (--miss-counters)
+    COUNT_LLC_MISSES    = 5,
+    COUNT_MESSAGES      = 6,                // messages of end points sent, and their bytes
+    COUNT_MESSAGE_BYTES = 7,
+    COUNT_ENDPTS_SENT   = 8,                // end points in the messages
+    COUNT_EXITS         = 9,                // finished particles for each ExitReason, COUNT_EXITS + reason
+    NUM_COUNTS          = COUNT_EXITS + NUM_EXIT_REASONS
+};
+
 // incremental stats
 // NB, default initialization is 0.0 for all members
 struct Stats
@@ -41,6 +83,7 @@ struct Stats
     double cur_callback_time;
     double cur_mean_callback_time;
     double prev_mean_callback_time;
+    size_t counts[NUM_COUNTS];              // TraceCount counters, summed over trials
 };
 
 // one point
@@ -49,6 +92,9 @@ struct Pt
     diy::Point<float, 3>    coords;
 };
 
+// points are copied as raw bytes in bulk, see WIRE_RAW and Serialization<SegmentStore>
+static_assert(std::is_trivially_copyable<Pt>::value, "Pt must be trivially copyable");
+
 // whether a point is inside given bounds
 // on the boundary is considered inside
 bool inside(const Pt& pt, const Bounds bounds)
@@ -59,6 +105,21 @@ bool inside(const Pt& pt, const Bounds bounds)
     return true;
 }
 
+// what is kept of a finished particle in endpoint mode, instead of its trajectory
+struct ParticleSummary
+{
+    int   pid;                               // particle ID, unique within a block
+    int   gid;                               // block gid of seed particle
+    Pt    seed;                              // seed point
+    Pt    end;                               // final point
+    float len;                               // arc length of the trajectory
+    int   nsteps;                            // number of steps
+    int   reason;                            // ExitReason
+};
+
+// summaries are merged as raw bytes, see merge_traces()
+static_assert(std::is_trivially_copyable<ParticleSummary>::value, "ParticleSummary must be trivially copyable");
+
 // one end point of a particle trace segment
 struct EndPt
 {
@@ -66,6 +127,12 @@ struct EndPt
     Pt   pt;                                 // end pointof the trace
     int  gid;                                // block gid of seed particle (start) of this trace
     int  nsteps;                             // number of steps this particle went so far
+    float h;                                 // current step size of adaptive integration (0 = not started)
+    Pt   seed;                               // seed point of the trace
+    float len;                               // arc length of the trace so far
+    Pt   anchor;                             // point at the start of the current displacement window
+    int  cell[3];                            // cell of the end point, min. corner
+    int  cell_steps;                         // consecutive steps taken in that cell
 
     const float& operator [](int i) const { return pt.coords[i]; }
     float& operator [](int i)             { return pt.coords[i]; }
@@ -75,26 +142,247 @@ struct EndPt
             pid      = 0;
             gid      = 0;
             nsteps   = 0;
+            h        = 0.0;
+            len      = 0.0;
+            cell[0]  = cell[1] = cell[2] = 0;
+            cell_steps = 0;
         }
     EndPt(struct Segment& s);                // extract the end point of a segment
 };
 
+// zigzag varints, for the compact forms of trajectory points and end points
+inline void put_varint(vector<uint8_t>& bytes, uint64_t z)
+{
+    while (z >= 0x80)
+    {
+        bytes.push_back((uint8_t)(z | 0x80));
+        z >>= 7;
+    }
+    bytes.push_back((uint8_t)z);
+}
+
+inline uint64_t get_varint(const uint8_t*& p)
+{
+    uint64_t z = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+        z |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            break;
+    }
+    return z;
+}
+
+inline size_t varint_size(uint64_t z)
+{
+    size_t n = 1;
+    for (; z >= 0x80; z >>= 7)
+        n++;
+    return n;
+}
+
+inline uint64_t zigzag(int64_t r)           { return ((uint64_t)r << 1) ^ (uint64_t)(r >> 63); }
+inline int64_t  unzigzag(uint64_t z)        { return (int64_t)(z >> 1) ^ -(int64_t)(z & 1); }
+
+inline void put_float(vector<uint8_t>& bytes, float x)
+{
+    uint8_t b[sizeof(float)];
+    memcpy(b, &x, sizeof(float));
+    bytes.insert(bytes.end(), b, b + sizeof(float));
+}
+
+inline float get_float(const uint8_t*& p)
+{
+    float x;
+    memcpy(&x, p, sizeof(float));
+    p += sizeof(float);
+    return x;
+}
+
+// appends field(j), j = 0, ..., n - 1, as an array of T
+template<class T, class F>
+inline void put_column(vector<uint8_t>& bytes, size_t n, F field)
+{
+    size_t o = bytes.size();
+    bytes.resize(o + n * sizeof(T));
+    for (size_t j = 0; j < n; j++)
+    {
+        T v = field(j);
+        memcpy(&bytes[o + j * sizeof(T)], &v, sizeof(T));
+    }
+}
+
+// compact form of a message of end points, written by encode_endpts() and read by
+// ParticlePool::append_encoded()
+// header: number of end points (varint), WireFlags (byte), quantum (float, WIRE_QUANTIZED only)
+// each end point:
+// - coordinates as floats, or with WIRE_QUANTIZED, zigzag varints of multiples of quantum from the
+//   min. corner of the core of the receiving block; an end point lies near a face of that block, so
+//   the multiples are small, but coordinates are then only kept to within quantum / 2
+// - pid, nsteps as varints, gid as the zigzag varint of its difference to the gid of the sending block
+// - h as float (WIRE_H), seed and len as floats (WIRE_SUMMARY), anchor as floats (WIRE_ANCHOR),
+//   cell as zigzag varints of its difference to ref and cell_steps as varint (WIRE_CELL);
+//   the fields that are left out are only used by some integrators and settings, and are reset
+// with WIRE_RAW, the end points are not encoded one by one, but sent as the arrays of ParticlePool
+// (x[0], x[1], x[2], pid, nsteps, gid, then h, seed, len, anchor, cell, cell_steps as flagged), which
+// the receiver copies into its pool in one block each; larger, but nothing to decode
+enum WireFlags
+{
+    WIRE_QUANTIZED  = 1,
+    WIRE_H          = 2,
+    WIRE_SUMMARY    = 4,
+    WIRE_ANCHOR     = 8,
+    WIRE_RAW        = 16,
+    WIRE_CELL       = 32
+};
+
+struct WireFormat
+{
+    int     flags;                           // WireFlags
+    float   quantum;                         // WIRE_QUANTIZED only
+};
+
+// appends the compact form of end points pts[0, n) to bytes
+// ref is the min. corner of the core of the receiving block, src_gid the gid of the sending block
+inline void encode_endpts(const EndPt*      pts,
+                          size_t            n,
+                          const WireFormat& wf,
+                          const int*        ref,
+                          int               src_gid,
+                          vector<uint8_t>&  bytes)
+{
+    put_varint(bytes, n);
+    bytes.push_back((uint8_t)wf.flags);
+    if (wf.flags & WIRE_RAW)
+    {
+        for (int d = 0; d < 3; d++)
+            put_column<float>(bytes, n, [&](size_t j) { return pts[j][d]; });
+        put_column<int>(bytes, n, [&](size_t j) { return pts[j].pid; });
+        put_column<int>(bytes, n, [&](size_t j) { return pts[j].nsteps; });
+        put_column<int>(bytes, n, [&](size_t j) { return pts[j].gid; });
+        if (wf.flags & WIRE_H)
+            put_column<float>(bytes, n, [&](size_t j) { return pts[j].h; });
+        if (wf.flags & WIRE_SUMMARY)
+        {
+            put_column<Pt>(bytes, n, [&](size_t j) { return pts[j].seed; });
+            put_column<float>(bytes, n, [&](size_t j) { return pts[j].len; });
+        }
+        if (wf.flags & WIRE_ANCHOR)
+            put_column<Pt>(bytes, n, [&](size_t j) { return pts[j].anchor; });
+        if (wf.flags & WIRE_CELL)
+        {
+            for (int d = 0; d < 3; d++)
+                put_column<int>(bytes, n, [&](size_t j) { return pts[j].cell[d]; });
+            put_column<int>(bytes, n, [&](size_t j) { return pts[j].cell_steps; });
+        }
+        return;
+    }
+    if (wf.flags & WIRE_QUANTIZED)
+        put_float(bytes, wf.quantum);
+    for (size_t j = 0; j < n; j++)
+    {
+        const EndPt& p = pts[j];
+        for (int d = 0; d < 3; d++)
+        {
+            if (wf.flags & WIRE_QUANTIZED)
+                put_varint(bytes, zigzag(llround((p[d] - ref[d]) / (double)wf.quantum)));
+            else
+                put_float(bytes, p[d]);
+        }
+        put_varint(bytes, (uint32_t)p.pid);
+        put_varint(bytes, (uint32_t)p.nsteps);
+        put_varint(bytes, zigzag((int64_t)p.gid - src_gid));
+        if (wf.flags & WIRE_H)
+            put_float(bytes, p.h);
+        if (wf.flags & WIRE_SUMMARY)
+        {
+            for (int d = 0; d < 3; d++)
+                put_float(bytes, p.seed.coords[d]);
+            put_float(bytes, p.len);
+        }
+        if (wf.flags & WIRE_ANCHOR)
+            for (int d = 0; d < 3; d++)
+                put_float(bytes, p.anchor.coords[d]);
+        if (wf.flags & WIRE_CELL)
+        {
+            for (int d = 0; d < 3; d++)
+                put_varint(bytes, zigzag((int64_t)p.cell[d] - ref[d]));
+            put_varint(bytes, (uint32_t)p.cell_steps);
+        }
+    }
+}
+
+// bytes of end point p in the form of encode_endpts(), not counting the header of the message
+inline size_t encoded_size(const EndPt&      p,
+                           const WireFormat& wf,
+                           const int*        ref,
+                           int               src_gid)
+{
+    size_t n = 0;
+    if (wf.flags & WIRE_RAW)
+        n += 3 * sizeof(float) + 3 * sizeof(int);
+    else
+    {
+        for (int d = 0; d < 3; d++)
+        {
+            if (wf.flags & WIRE_QUANTIZED)
+                n += varint_size(zigzag(llround((p[d] - ref[d]) / (double)wf.quantum)));
+            else
+                n += sizeof(float);
+        }
+        n += varint_size((uint32_t)p.pid) + varint_size((uint32_t)p.nsteps) +
+             varint_size(zigzag((int64_t)p.gid - src_gid));
+    }
+    if (wf.flags & WIRE_H)
+        n += sizeof(float);
+    if (wf.flags & WIRE_SUMMARY)
+        n += 4 * sizeof(float);
+    if (wf.flags & WIRE_ANCHOR)
+        n += 3 * sizeof(float);
+    if (wf.flags & WIRE_CELL)
+    {
+        if (wf.flags & WIRE_RAW)
+            n += 4 * sizeof(int);
+        else
+        {
+            for (int d = 0; d < 3; d++)
+                n += varint_size(zigzag((int64_t)p.cell[d] - ref[d]));
+            n += varint_size((uint32_t)p.cell_steps);
+        }
+    }
+    return n;
+}
+
+// end points waiting to be sent to one neighbor (iexchange), see hold_endpts()
+struct HeldEndPts
+{
+    vector<EndPt> pts;
+    size_t        bytes;                     // their size in a message, see encoded_size()
+    double        since;                     // MPI_Wtime() when the oldest one was added
+
+    HeldEndPts() : bytes(0), since(0.0)     {}
+};
+
 // one segment of a particle trace (trajectory)
 struct Segment
 {
     int        pid;                          // particle ID, unique within a block
     vector<Pt> pts;                          // points along trace
     int        gid;                          // block gid of seed particle (start) of this trace
+    int        reason;                       // ExitReason of the particle at the end of this segment,
+                                             // EXIT_NONE if it continues in another block
 
     Segment()
         {
             pid      = 0;
             gid      = 0;
+            reason   = EXIT_NONE;
         }
     Segment(EndPt& p)                        // construct a segment from one point
         {
             pid      = p.pid;
             gid      = p.gid;
+            reason   = EXIT_NONE;
             Pt pt    { { p[0], p[1], p[2] } };
             pts.push_back(pt);
         }
@@ -110,6 +398,172 @@ struct Segment
         }
 };
 
+// finished trajectory segments of a block in one flat (CSR) arena: the points of all segments back
+// to back, with segment i owning points [offsets[i], offsets[i + 1])
+// segments are traced into reusable Segment buffers and copied in with push_back() when done,
+// so that tracing does not allocate per segment, and merging and serializing the store are a
+// few bulk copies
+//
+// with quantum > 0, the points are stored in compact form instead of as floats: each coordinate
+// is quantized to a multiple of quantum relative to origin, and the quantized coordinates of a
+// segment are delta-encoded and written to bytes as zigzag varints, segment i owning bytes
+// [boffsets[i], boffsets[i + 1]); the error is quantum / 2 per coordinate (plus float rounding), not
+// accumulated along a segment, and the last point of a segment decodes to exactly the same
+// coordinates as the first point of the segment continuing it
+struct SegmentStore
+{
+    vector<Pt>      pts;                     // points of all segments (quantum = 0)
+    vector<size_t>  offsets;                 // start of each segment in the points, plus the end of the last one
+    vector<int>     pid;                     // particle ID of each segment
+    vector<int>     gid;                     // block gid of seed particle of each segment
+    vector<int>     reason;                  // ExitReason at the end of each segment
+    float           quantum;                 // quantization step of the compact form, 0 = points stored as floats
+    Pt              origin;                  // origin of the quantized coordinates
+    vector<uint8_t> bytes;                   // compact points of all segments (quantum > 0)
+    vector<size_t>  boffsets;                // start of each segment in bytes, plus the end of the last one
+
+    SegmentStore() : offsets(1, 0), quantum(0.0), boffsets(1, 0)
+        {
+            origin.coords[0] = origin.coords[1] = origin.coords[2] = 0.0;
+        }
+
+    size_t      size() const                 { return pid.size(); }
+    size_t      npts(size_t i) const         { return offsets[i + 1] - offsets[i]; }
+
+    // switches to the compact form (quantum > 0) or back to floats; the store must be empty
+    void set_quantum(float quantum_, const Pt& origin_)
+        {
+            quantum = quantum_;
+            origin  = origin_;
+        }
+
+    // keeps the capacity
+    void clear()
+        {
+            pts.clear();
+            offsets.resize(1);
+            pid.clear();
+            gid.clear();
+            reason.clear();
+            bytes.clear();
+            boffsets.resize(1);
+        }
+
+    void push_back(const Segment& s)
+        {
+            if (quantum > 0.0)
+                encode(s.pts);
+            else
+                pts.insert(pts.end(), s.pts.begin(), s.pts.end());
+            offsets.push_back(offsets.back() + s.pts.size());
+            pid.push_back(s.pid);
+            gid.push_back(s.gid);
+            reason.push_back(s.reason);
+        }
+
+    // appends a store serialized by Serialization<SegmentStore>, reading its arrays straight into
+    // the ends of the arrays of this one; it must be in the same form, unless this store is empty
+    void append(diy::BinaryBuffer& bb)
+        {
+            size_t n, npts, nbytes;
+            diy::load(bb, n);
+            diy::load(bb, npts);
+            diy::load(bb, nbytes);
+            diy::load(bb, quantum);
+            diy::load(bb, origin);
+            size_t m = size();
+            load_offsets(bb, offsets, m, n);
+            load_tail(bb, pid,    n);
+            load_tail(bb, gid,    n);
+            load_tail(bb, reason, n);
+            load_tail(bb, pts,    npts);
+            if (quantum > 0.0)
+            {
+                load_offsets(bb, boffsets, m, n);
+                load_tail(bb, bytes, nbytes);
+            }
+        }
+
+    // o must be in the same form (quantum, origin)
+    void append(const SegmentStore& o)
+        {
+            size_t base = offsets.back();
+            for (size_t i = 1; i < o.offsets.size(); i++)
+                offsets.push_back(base + o.offsets[i]);
+            pts.insert(pts.end(), o.pts.begin(), o.pts.end());
+            base = boffsets.back();
+            for (size_t i = 1; i < o.boffsets.size(); i++)
+                boffsets.push_back(base + o.boffsets[i]);
+            bytes.insert(bytes.end(), o.bytes.begin(), o.bytes.end());
+            pid.insert(pid.end(), o.pid.begin(), o.pid.end());
+            gid.insert(gid.end(), o.gid.begin(), o.gid.end());
+            reason.insert(reason.end(), o.reason.begin(), o.reason.end());
+        }
+
+    // points of segment i, in either form
+    void get(size_t i, vector<Pt>& out) const
+        {
+            out.clear();
+            if (quantum <= 0.0)
+            {
+                out.insert(out.end(), pts.begin() + offsets[i], pts.begin() + offsets[i + 1]);
+                return;
+            }
+            const uint8_t* p = &bytes[boffsets[i]];
+            int64_t q[3] = { 0, 0, 0 };
+            for (size_t j = 0; j < npts(i); j++)
+            {
+                Pt pt;
+                for (int d = 0; d < 3; d++)
+                {
+                    q[d] += unzigzag(get_varint(p));
+                    pt.coords[d] = (float)(origin.coords[d] + (double)quantum * q[d]);
+                }
+                out.push_back(pt);
+            }
+        }
+
+    // bytes of storage in use
+    size_t used_bytes() const
+        {
+            return pts.size() * sizeof(Pt) + (offsets.size() + boffsets.size()) * sizeof(size_t) +
+                (pid.size() + gid.size()) * sizeof(int) + bytes.size();
+        }
+
+    // appends the compact form of points p to bytes
+    void encode(const vector<Pt>& p)
+        {
+            int64_t prev[3] = { 0, 0, 0 };
+            for (size_t j = 0; j < p.size(); j++)
+                for (int d = 0; d < 3; d++)
+                {
+                    int64_t q = llround((p[j].coords[d] - origin.coords[d]) / (double)quantum);
+                    put_varint(bytes, zigzag(q - prev[d]));
+                    prev[d] = q;
+                }
+            boffsets.push_back(bytes.size());
+        }
+
+private:
+    template<class T>
+    static void load_tail(diy::BinaryBuffer& bb, vector<T>& v, size_t n)
+        {
+            size_t m = v.size();
+            v.resize(m + n);
+            diy::load(bb, v.data() + m, n);
+        }
+
+    // the n + 1 offsets of n segments, which start from 0, rebased to follow segment m - 1
+    static void load_offsets(diy::BinaryBuffer& bb, vector<size_t>& offsets, size_t m, size_t n)
+        {
+            size_t base = offsets.back();
+            offsets.resize(m + n + 1);
+            diy::load(bb, offsets.data() + m, n + 1);
+            for (size_t i = m; i <= m + n; i++)
+                offsets[i] += base;
+        }
+};
+
 // following constructor defined out of line because references Segment, which needed
 // to be defined first
 EndPt::
@@ -117,32 +571,370 @@ EndPt(Segment& s)                       // extract the end point of a segment
 {
     pid = s.pid;
     gid = s.gid;
+    nsteps = 0;
+    h   = 0.0;
+    len = 0.0;
+    anchor = s.pts.front();
     pt.coords[0] = s.pts.back().coords[0];
     pt.coords[1] = s.pts.back().coords[1];
     pt.coords[2] = s.pts.back().coords[2];
+    for (int i = 0; i < 3; i++)
+        cell[i] = floor(pt.coords[i]);
+    cell_steps = 0;
 }
 
-// specialize the serialization of a segment
+// spreads bits 0, ..., 20 of v to bits 0, 3, 6, ..., 60, for 3D Morton codes
+inline uint64_t spread_bits3(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2)  & 0x1249249249249249ULL;
+    return v;
+}
+
+// particles waiting to be traced in a block, in structure-of-arrays form
+// clear() keeps the capacity, so that the pool is reused across rounds and callbacks without
+// reallocation, and the packet integrators load their lanes straight from the arrays
+struct ParticlePool
+{
+    vector<float>   x[3];                    // coordinates
+    vector<int>     pid;                     // particle ID, unique within a block
+    vector<int>     gid;                     // block gid of seed particle
+    vector<int>     nsteps;                  // number of steps this particle went so far
+    vector<float>   h;                       // current step size of adaptive integration (0 = not started)
+    vector<Pt>      seed;                    // seed point
+    vector<float>   len;                     // arc length so far
+    vector<Pt>      anchor;                  // point at the start of the current displacement window
+    vector<int>     cell[3];                 // cell of the particle, min. corner
+    vector<int>     cell_steps;              // consecutive steps taken in that cell
+
+    size_t  size() const                     { return pid.size(); }
+    bool    empty() const                    { return pid.empty(); }
+
+    void clear()
+        {
+            for (int i = 0; i < 3; i++)
+                x[i].clear();
+            pid.clear();
+            gid.clear();
+            nsteps.clear();
+            h.clear();
+            seed.clear();
+            len.clear();
+            anchor.clear();
+            for (int i = 0; i < 3; i++)
+                cell[i].clear();
+            cell_steps.clear();
+        }
+
+    void reserve(size_t n)
+        {
+            for (int i = 0; i < 3; i++)
+                x[i].reserve(n);
+            pid.reserve(n);
+            gid.reserve(n);
+            nsteps.reserve(n);
+            h.reserve(n);
+            seed.reserve(n);
+            len.reserve(n);
+            anchor.reserve(n);
+            for (int i = 0; i < 3; i++)
+                cell[i].reserve(n);
+            cell_steps.reserve(n);
+        }
+
+    void push_back(const EndPt& p)
+        {
+            for (int i = 0; i < 3; i++)
+                x[i].push_back(p[i]);
+            pid.push_back(p.pid);
+            gid.push_back(p.gid);
+            nsteps.push_back(p.nsteps);
+            h.push_back(p.h);
+            seed.push_back(p.seed);
+            len.push_back(p.len);
+            anchor.push_back(p.anchor);
+            for (int i = 0; i < 3; i++)
+                cell[i].push_back(p.cell[i]);
+            cell_steps.push_back(p.cell_steps);
+        }
+
+    void append(const EndPt* p, size_t n)
+        {
+            reserve(size() + n);
+            for (size_t j = 0; j < n; j++)
+                push_back(p[j]);
+        }
+
+    // reorders the particles by the Morton code of the cell containing them, cells numbered from
+    // grid point st in a grid of sz points, so that consecutive particles interpolate in nearby
+    // cells; particles outside the grid count as in the nearest cell
+    // LSD radix sort of the codes, 8 bits per pass, as many passes as the codes for sz need
+    void sort_by_cell(const int* st, const int* sz)
+        {
+            size_t n    = size();
+            int    bits = 0;                    // bits per cell index
+            for (int i = 0; i < 3; i++)
+                while (bits < 21 && (1 << bits) < sz[i] - 1)
+                    bits++;
+
+            vector<uint64_t> key(n), key2(n);
+            vector<uint32_t> order(n), order2(n);
+            for (size_t j = 0; j < n; j++)
+            {
+                uint64_t code = 0;
+                for (int i = 0; i < 3; i++)
+                {
+                    float c = floor(x[i][j] - st[i]);
+                    if (!(c > 0.0))                 // also for NaN
+                        c = 0.0;
+                    if (c > sz[i] - 2)
+                        c = sz[i] > 1 ? sz[i] - 2 : 0;
+                    code |= spread_bits3((uint64_t)c) << i;
+                }
+                key[j]   = code;
+                order[j] = j;
+            }
+
+            for (int shift = 0; shift < 3 * bits; shift += 8)
+            {
+                size_t count[257] = { 0 };
+                for (size_t j = 0; j < n; j++)
+                    count[((key[j] >> shift) & 0xff) + 1]++;
+                for (int d = 0; d < 256; d++)
+                    count[d + 1] += count[d];
+                for (size_t j = 0; j < n; j++)
+                {
+                    size_t k  = count[(key[j] >> shift) & 0xff]++;
+                    key2[k]   = key[j];
+                    order2[k] = order[j];
+                }
+                key.swap(key2);
+                order.swap(order2);
+            }
+
+            for (int i = 0; i < 3; i++)
+                permute(x[i], order);
+            permute(pid,    order);
+            permute(gid,    order);
+            permute(nsteps, order);
+            permute(h,      order);
+            permute(seed,   order);
+            permute(len,    order);
+            permute(anchor, order);
+            for (int i = 0; i < 3; i++)
+                permute(cell[i], order);
+            permute(cell_steps, order);
+        }
+
+    EndPt operator [](size_t j) const
+        {
+            EndPt p;
+            p.pid    = pid[j];
+            p.gid    = gid[j];
+            p.nsteps = nsteps[j];
+            p.h      = h[j];
+            p.seed   = seed[j];
+            p.len    = len[j];
+            p.anchor = anchor[j];
+            for (int i = 0; i < 3; i++)
+            {
+                p[i]      = x[i][j];
+                p.cell[i] = cell[i][j];
+            }
+            p.cell_steps = cell_steps[j];
+            return p;
+        }
+
+    // appends the end points of a message in the compact form of encode_endpts(), starting at p, and
+    // returns the end of the message; ref and src_gid are the ones it was encoded with
+    const uint8_t* append_encoded(const uint8_t* p, const int* ref, int src_gid)
+        {
+            size_t n     = get_varint(p);
+            int    flags = *p++;
+            if (flags & WIRE_RAW)
+                return append_raw(p, n, flags);
+            float  q     = (flags & WIRE_QUANTIZED) ? get_float(p) : 0.0;
+            reserve(size() + n);
+            for (size_t j = 0; j < n; j++)
+            {
+                EndPt e;
+                for (int d = 0; d < 3; d++)
+                {
+                    if (flags & WIRE_QUANTIZED)
+                        e[d] = (float)(ref[d] + (double)q * unzigzag(get_varint(p)));
+                    else
+                        e[d] = get_float(p);
+                }
+                e.pid    = (int)get_varint(p);
+                e.nsteps = (int)get_varint(p);
+                e.gid    = (int)(src_gid + unzigzag(get_varint(p)));
+                if (flags & WIRE_H)
+                    e.h = get_float(p);
+                e.seed = e.pt;
+                if (flags & WIRE_SUMMARY)
+                {
+                    for (int d = 0; d < 3; d++)
+                        e.seed.coords[d] = get_float(p);
+                    e.len = get_float(p);
+                }
+                e.anchor = e.pt;
+                if (flags & WIRE_ANCHOR)
+                    for (int d = 0; d < 3; d++)
+                        e.anchor.coords[d] = get_float(p);
+                if (flags & WIRE_CELL)
+                {
+                    for (int d = 0; d < 3; d++)
+                        e.cell[d] = (int)(ref[d] + unzigzag(get_varint(p)));
+                    e.cell_steps = (int)get_varint(p);
+                }
+                else
+                    for (int d = 0; d < 3; d++)
+                        e.cell[d] = floor(e[d]);
+                push_back(e);
+            }
+            return p;
+        }
+
+    // removes the particles j with marked[j] != 0, keeping the order of the others
+    void erase_marked(const vector<char>& marked)
+        {
+            for (int i = 0; i < 3; i++)
+                erase_marked(x[i], marked);
+            erase_marked(pid,    marked);
+            erase_marked(gid,    marked);
+            erase_marked(nsteps, marked);
+            erase_marked(h,      marked);
+            erase_marked(seed,   marked);
+            erase_marked(len,    marked);
+            erase_marked(anchor, marked);
+            for (int i = 0; i < 3; i++)
+                erase_marked(cell[i], marked);
+            erase_marked(cell_steps, marked);
+        }
+
+private:
+    // the arrays of a WIRE_RAW message, see append_encoded()
+    const uint8_t* append_raw(const uint8_t* p, size_t n, int flags)
+        {
+            size_t m = size();
+            for (int i = 0; i < 3; i++)
+                get_column(x[i], n, p);
+            get_column(pid,    n, p);
+            get_column(nsteps, n, p);
+            get_column(gid,    n, p);
+            if (flags & WIRE_H)
+                get_column(h, n, p);
+            else
+                h.resize(m + n, 0.0);
+            if (flags & WIRE_SUMMARY)
+            {
+                get_column(seed, n, p);
+                get_column(len,  n, p);
+            }
+            else
+            {
+                append_pts(seed, m, n);
+                len.resize(m + n, 0.0);
+            }
+            if (flags & WIRE_ANCHOR)
+                get_column(anchor, n, p);
+            else
+                append_pts(anchor, m, n);
+            if (flags & WIRE_CELL)
+            {
+                for (int i = 0; i < 3; i++)
+                    get_column(cell[i], n, p);
+                get_column(cell_steps, n, p);
+            }
+            else
+            {
+                for (int i = 0; i < 3; i++)
+                {
+                    cell[i].resize(m + n);
+                    for (size_t j = m; j < m + n; j++)
+                        cell[i][j] = floor(x[i][j]);
+                }
+                cell_steps.resize(m + n, 0);
+            }
+            return p;
+        }
+
+    // appends the points of particles m, ..., m + n - 1 to v
+    void append_pts(vector<Pt>& v, size_t m, size_t n) const
+        {
+            v.resize(m + n);
+            for (size_t j = m; j < m + n; j++)
+                for (int i = 0; i < 3; i++)
+                    v[j].coords[i] = x[i][j];
+        }
+
+    // appends n elements copied from p, and advances p past them
+    template<class T>
+    static void get_column(vector<T>& v, size_t n, const uint8_t*& p)
+        {
+            size_t m = v.size();
+            v.resize(m + n);
+            memcpy(v.data() + m, p, n * sizeof(T));
+            p += n * sizeof(T);
+        }
+
+    template<class T>
+    static void erase_marked(vector<T>& v, const vector<char>& marked)
+        {
+            size_t k = 0;
+            for (size_t j = 0; j < v.size(); j++)
+                if (!marked[j])
+                    v[k++] = v[j];
+            v.resize(k);
+        }
+
+    // v[j] = old v[order[j]]
+    template<class T>
+    static void permute(vector<T>& v, const vector<uint32_t>& order)
+        {
+            vector<T> w(v.size());
+            for (size_t j = 0; j < order.size(); j++)
+                w[j] = v[order[j]];
+            v.swap(w);
+        }
+};
+
+// specialize the serialization of a segment store
 namespace diy
 {
+    // the arrays of a segment store as a few binary copies
     template<>
-    struct Serialization<Segment>
+    struct Serialization<SegmentStore>
     {
         static
-        void save(diy::BinaryBuffer& bb, const Segment& x)
+        void save(diy::BinaryBuffer& bb, const SegmentStore& x)
             {
-                diy::Serialization<int>::save(bb, x.pid);
-                diy::Serialization< vector <Pt> >::
-                    save(bb, static_cast< const vector<Pt>& >(x.pts));
-                diy::Serialization<int>::save(bb, x.gid);
+                size_t n = x.size(), npts = x.pts.size(), nbytes = x.bytes.size();
+                diy::save(bb, n);
+                diy::save(bb, npts);
+                diy::save(bb, nbytes);
+                diy::save(bb, x.quantum);
+                diy::save(bb, x.origin);
+                diy::save(bb, x.offsets.data(), n + 1);
+                diy::save(bb, x.pid.data(), n);
+                diy::save(bb, x.gid.data(), n);
+                diy::save(bb, x.reason.data(), n);
+                diy::save(bb, x.pts.data(), npts);
+                if (x.quantum > 0.0)
+                {
+                    diy::save(bb, x.boffsets.data(), n + 1);
+                    diy::save(bb, x.bytes.data(), nbytes);
+                }
             }
         static
-        void load(diy::BinaryBuffer& bb, Segment& x)
+        void load(diy::BinaryBuffer& bb, SegmentStore& x)
             {
-                diy::Serialization<int>::load(bb, x.pid);
-                diy::Serialization< vector<Pt> >::
-                    load(bb, static_cast< vector<Pt>& >(x.pts));
-                diy::Serialization<int>::load(bb, x.gid);
+                x.clear();
+                x.append(bb);
             }
     };
 }
@@ -0,0 +1,74 @@
+//---------------------------------------------------------------------------
+//
+// counter-based random numbers (Philox4x32-10)
+//
+// ref: Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3", SC 2011
+//
+// a counter-based generator has no state: the random numbers are a pure function of a counter
+// and a key, so a particle keyed on (gid, pid, nsteps) draws the same numbers no matter which
+// block, rank, or thread advances it, in what order, or in which lane of a packet
+//
+//--------------------------------------------------------------------------
+
+#ifndef _RNG_HPP
+#define _RNG_HPP
+
+#include <stdint.h>
+
+const uint32_t PHILOX_M0 = 0xD2511F53;      // round multipliers
+const uint32_t PHILOX_M1 = 0xCD9E8D57;
+const uint32_t PHILOX_W0 = 0x9E3779B9;      // key schedule increments
+const uint32_t PHILOX_W1 = 0xBB67AE85;
+
+// 4 random 32-bit words from counter c and key k
+inline void philox4x32(const uint32_t* c, const uint32_t* k, uint32_t* r)
+{
+    uint32_t c0 = c[0], c1 = c[1], c2 = c[2], c3 = c[3];
+    uint32_t k0 = k[0], k1 = k[1];
+    for (int i = 0; i < 10; i++)
+    {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    r[0] = c0; r[1] = c1; r[2] = c2; r[3] = c3;
+}
+
+// same for n counters in structure-of-arrays form, (c[0][l], c[1][l], c[2][l], 0) for lane l
+// written as independent lanes so that the compiler vectorizes it
+inline void philox4x32_packet(int                      n,
+                              const uint32_t* const*   c,
+                              const uint32_t*          k,
+                              uint32_t* const*         r)
+{
+    for (int l = 0; l < n; l++)
+    {
+        uint32_t c0 = c[0][l], c1 = c[1][l], c2 = c[2][l], c3 = 0;
+        uint32_t k0 = k[0], k1 = k[1];
+        for (int i = 0; i < 10; i++)
+        {
+            uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+            uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+            c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+            c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+            c1 = (uint32_t)p1;
+            c3 = (uint32_t)p0;
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        r[0][l] = c0; r[1][l] = c1; r[2][l] = c2; r[3][l] = c3;
+    }
+}
+
+// uniform float in [0, 1) from the top 24 bits of a random word
+inline float rng_uniform(uint32_t x)
+{
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <math.h>
 #include "diy/link.hpp"
 #include <cstdio>
+#include <vector>
 
 // This utility is the same as diy's pick.hpp, but ensures that distance computation is
 // done in double precision even though the bounds are integer
@@ -65,6 +66,96 @@ namespace utl{
                     *out++ = n;
             } // for all neighbors
         }
+
+    // Same as in() with core = true, for regular decompositions in up to 3 dimensions, in constant time
+    //
+    // A neighbor core can contain a point only if it lies in a direction in which the point is outside
+    // the core of this block, or on its boundary (when faces are shared), so at most 8 of the 27
+    // directions need to be checked. (With bounds, the ghost layers overlap this block, and the
+    // lookup would miss neighbors, hence cores only.) The neighbors' wrapped cores are computed once,
+    // when the table is built.
+    // find() returns the lowest link index among the neighbors containing the point, i.e., the first
+    // neighbor in() would output, or -1 if there is none.
+    template<class Bounds>
+    struct NeighborTable
+    {
+        NeighborTable(
+            const diy::RegularLink<Bounds>& link,       // neighbors
+            const Bounds&                   domain) :   // global domain bounds
+            own(link.core()),
+            dim(link.dimension()),
+            nbr_bounds(27, own)
+        {
+            for (int k = 0; k < 27; k++)
+                nbr[k] = -1;
+            for (int n = 0; n < link.size(); n++)
+            {
+                int k = 0;                              // same slot as in find(), direction 0 beyond dim
+                for (int i = 2; i >= 0; i--)
+                    k = 3 * k + (i < dim ? link.direction(n)[i] : 0) + 1;
+                if (nbr[k] >= 0)                        // several neighbors in one direction, e.g., a
+                {                                       // periodic dimension with two blocks: the lowest first
+                    extra.push_back(n);
+                    continue;
+                }
+                nbr[k]        = n;
+                nbr_bounds[k] = link.core(n);
+                wrap_bounds(nbr_bounds[k], link.wrap(n), domain);
+            }
+            if (!extra.empty())
+                for (int n = 0; n < link.size(); n++)
+                {
+                    Bounds b = link.core(n);
+                    wrap_bounds(b, link.wrap(n), domain);
+                    all_bounds.push_back(b);
+                }
+        }
+
+        template<class Point>
+        int find(const Point& p) const
+        {
+            if (!extra.empty())                         // not one neighbor per direction, check all of them
+            {
+                for (size_t n = 0; n < all_bounds.size(); n++)
+                    if (distance(all_bounds[n], p) == 0)
+                        return n;
+                return -1;
+            }
+
+            // range of directions in each dimension that can contain p
+            int lo[3] = { 0, 0, 0 }, hi[3] = { 0, 0, 0 };
+            for (int i = 0; i < dim; i++)
+            {
+                if ((double)p[i] <= (double)own.min[i])
+                    lo[i] = -1;
+                if ((double)p[i] >= (double)own.max[i])
+                    hi[i] = 1;
+                if ((double)p[i] < (double)own.min[i])
+                    hi[i] = -1;
+                if ((double)p[i] > (double)own.max[i])
+                    lo[i] = 1;
+            }
+
+            int best = -1;
+            for (int d2 = lo[2]; d2 <= hi[2]; d2++)
+                for (int d1 = lo[1]; d1 <= hi[1]; d1++)
+                    for (int d0 = lo[0]; d0 <= hi[0]; d0++)
+                    {
+                        int k = (d0 + 1) + 3 * (d1 + 1) + 9 * (d2 + 1);
+                        int n = nbr[k];
+                        if (n >= 0 && (best < 0 || n < best) && distance(nbr_bounds[k], p) == 0)
+                            best = n;
+                    }
+            return best;
+        }
+
+        Bounds              own;                        // core of this block
+        int                 dim;
+        int                 nbr[27];                    // link index of the neighbor in each direction, -1 = none
+        std::vector<Bounds> nbr_bounds;                 // its wrapped core, 27 of them
+        std::vector<int>    extra;                      // neighbors sharing a direction with another one
+        std::vector<Bounds> all_bounds;                 // wrapped cores of all neighbors, only if extra is not empty
+    };
 }
 
 #endif
@@ -0,0 +1,168 @@
+//---------------------------------------------------------------------------
+//
+// worker threads and work-stealing chunk queues for tracing the particles of one block
+// on several threads
+//
+// DIY threads parallelize over blocks only; when the particles are concentrated in a few blocks,
+// trace_particles() splits the particles of a block into chunks and traces them on a WorkerPool,
+// the threads taking chunks from ChunkQueues
+//
+//--------------------------------------------------------------------------
+
+#ifndef _WORKPOOL_HPP
+#define _WORKPOOL_HPP
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// a fixed set of threads that run one parallel region at a time
+// the calling thread takes part in the region as thread 0, so a pool of size 1 has no workers
+class WorkerPool
+{
+public:
+    explicit WorkerPool(int nthreads) :
+        size_(nthreads > 1 ? nthreads : 1), job(NULL), generation(0), running(0), stop(false)
+    {
+        for (int tid = 1; tid < size_; tid++)
+            workers.push_back(std::thread(&WorkerPool::work, this, tid));
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        start_cv.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    int size() const                        { return size_; }
+
+    // runs f(tid) on all threads, tid = 0, ..., size() - 1, and returns when all are done
+    // returns false without running anything if the pool is already running a region for another
+    // caller (e.g., another DIY thread); the caller should then do the work alone
+    bool run(const std::function<void(int)>& f)
+    {
+        std::unique_lock<std::mutex> region(region_m, std::try_to_lock);
+        if (!region.owns_lock())
+            return false;
+
+        {
+            std::lock_guard<std::mutex> lock(m);
+            job     = &f;
+            running = size_ - 1;
+            generation++;
+        }
+        start_cv.notify_all();
+
+        f(0);
+
+        std::unique_lock<std::mutex> lock(m);
+        done_cv.wait(lock, [this] { return running == 0; });
+        job = NULL;
+        return true;
+    }
+
+private:
+    void work(int tid)
+    {
+        size_t seen = 0;
+        while (true)
+        {
+            const std::function<void(int)>* f;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                start_cv.wait(lock, [&] { return stop || generation != seen; });
+                if (stop)
+                    return;
+                seen = generation;
+                f    = job;
+            }
+
+            (*f)(tid);
+
+            std::lock_guard<std::mutex> lock(m);
+            if (--running == 0)
+                done_cv.notify_one();
+        }
+    }
+
+    int                                 size_;
+    std::vector<std::thread>            workers;
+    std::mutex                          region_m;       // one region at a time
+    std::mutex                          m;              // protects the members below
+    std::condition_variable             start_cv;
+    std::condition_variable             done_cv;
+    const std::function<void(int)>*     job;            // the current region
+    size_t                              generation;     // number of regions started
+    int                                 running;        // workers still in the current region
+    bool                                stop;
+};
+
+// chunks 0, ..., nchunks - 1 dealt out to nthreads queues in contiguous ranges
+// a thread takes the chunks of its own range from the front; when its range is empty, it steals
+// the back half of the range of another thread, so that the threads stay busy until all chunks are taken
+class ChunkQueues
+{
+public:
+    ChunkQueues(size_t nchunks, int nthreads) :
+        queues(nthreads)
+    {
+        for (int t = 0; t < nthreads; t++)
+        {
+            queues[t].lo = nchunks * t / nthreads;
+            queues[t].hi = nchunks * (t + 1) / nthreads;
+        }
+    }
+
+    // the next chunk c for thread tid, false when all chunks are taken
+    bool pop(int tid, size_t& c)
+    {
+        Queue& q = queues[tid];
+        {
+            std::lock_guard<std::mutex> lock(q.m);
+            if (q.lo < q.hi)
+            {
+                c = q.lo++;
+                return true;
+            }
+        }
+
+        int n = queues.size();
+        for (int k = 1; k < n; k++)
+        {
+            Queue& v = queues[(tid + k) % n];
+            size_t lo, hi;
+            {
+                std::lock_guard<std::mutex> lock(v.m);
+                if (v.lo >= v.hi)
+                    continue;
+                hi   = v.hi;
+                lo   = v.lo + (v.hi - v.lo) / 2;
+                v.hi = lo;
+            }
+            std::lock_guard<std::mutex> lock(q.m);
+            c    = lo;
+            q.lo = lo + 1;
+            q.hi = hi;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex  m;
+        size_t      lo, hi;                 // chunks not taken yet
+    };
+    std::deque<Queue>   queues;             // deque, since a mutex cannot be moved
+};
+
+#endif